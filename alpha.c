@@ -0,0 +1,189 @@
+#include "alpha.h"
+#include <pthread.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ALPHA_X86 1
+#include <immintrin.h>
+#endif
+
+// round(c * a / 255) for 8-bit c and a, without a division
+static inline uint8_t mulDiv255(unsigned c, unsigned a) {
+    unsigned t = c * a + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static void premultiplyRowScalar(uint8_t *row, int width) {
+    for (int x = 0; x < width; x++, row += 4) {
+        unsigned a = row[3];
+        row[0] = mulDiv255(row[0], a);
+        row[1] = mulDiv255(row[1], a);
+        row[2] = mulDiv255(row[2], a);
+    }
+}
+
+static const PremultiplyKernel scalarKernel = { "scalar", premultiplyRowScalar };
+
+#ifdef ALPHA_X86
+
+// SSE2: 4 pixels per step, widened to 16 bits. Alpha is multiplied by 255,
+// which leaves it as it is.
+
+__attribute__((target("sse2")))
+static inline __m128i premultiplyPairSse2(__m128i pixels, __m128i alpha_lane) {
+    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels, 0xff), 0xff);
+    alpha = _mm_or_si128(_mm_andnot_si128(alpha_lane, alpha), _mm_and_si128(alpha_lane, _mm_set1_epi16(255)));
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(pixels, alpha), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse2")))
+static void premultiplyRowSse2(uint8_t *row, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha_lane = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    int x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(row + x * 4));
+        __m128i lo = premultiplyPairSse2(_mm_unpacklo_epi8(pixels, zero), alpha_lane);
+        __m128i hi = premultiplyPairSse2(_mm_unpackhi_epi8(pixels, zero), alpha_lane);
+        _mm_storeu_si128((__m128i *)(row + x * 4), _mm_packus_epi16(lo, hi));
+    }
+    premultiplyRowScalar(row + x * 4, width - x);
+}
+
+static const PremultiplyKernel sse2Kernel = { "sse2", premultiplyRowSse2 };
+
+// AVX2: 8 pixels per step, the same within each 128-bit lane
+
+__attribute__((target("avx2")))
+static inline __m256i premultiplyPairAvx2(__m256i pixels, __m256i alpha_lane) {
+    __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(pixels, 0xff), 0xff);
+    alpha = _mm256_blendv_epi8(alpha, _mm256_set1_epi16(255), alpha_lane);
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(pixels, alpha), _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static void premultiplyRowAvx2(uint8_t *row, int width) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alpha_lane = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0);
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        __m256i pixels = _mm256_loadu_si256((const __m256i *)(row + x * 4));
+        // Unpacking and packing stay within lanes, so pixels keep their order
+        __m256i lo = premultiplyPairAvx2(_mm256_unpacklo_epi8(pixels, zero), alpha_lane);
+        __m256i hi = premultiplyPairAvx2(_mm256_unpackhi_epi8(pixels, zero), alpha_lane);
+        _mm256_storeu_si256((__m256i *)(row + x * 4), _mm256_packus_epi16(lo, hi));
+    }
+    premultiplyRowSse2(row + x * 4, width - x);
+}
+
+static const PremultiplyKernel avx2Kernel = { "avx2", premultiplyRowAvx2 };
+
+#endif
+
+static const PremultiplyKernel *kernels[3];
+static int kernel_count;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+// Once only: frames are premultiplied on the decode thread and the display thread
+static void findKernels(void) {
+    int n = 0;
+    kernels[n++] = &scalarKernel;
+#ifdef ALPHA_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        kernels[n++] = &sse2Kernel;
+    if (__builtin_cpu_supports("avx2"))
+        kernels[n++] = &avx2Kernel;
+#endif
+    kernel_count = n;
+}
+
+const PremultiplyKernel *const *supportedPremultiplyKernels(int *count) {
+    pthread_once(&kernels_once, findKernels);
+
+    *count = kernel_count;
+    return kernels;
+}
+
+const PremultiplyKernel *bestPremultiplyKernel(void) {
+    int count;
+    const PremultiplyKernel *const *kernels = supportedPremultiplyKernels(&count);
+    return kernels[count - 1];
+}
+
+void premultiplyRows(const PremultiplyKernel *kernel, uint8_t *data, int stride, int width,
+                     int y_start, int y_end) {
+    for (int row = y_start; row < y_end; row++) {
+        kernel->row(data + (ptrdiff_t)row * stride, width);
+    }
+}
+
+// Where the alpha of pixel x of a row is: byte offset + x * step
+static bool alphaLayout(const AVFrame *frame, int *plane, int *offset, int *step) {
+    switch (frame->format) {
+    case AV_PIX_FMT_BGRA:
+    case AV_PIX_FMT_RGBA:
+        *plane = 0, *offset = 3, *step = 4;
+        return true;
+    case AV_PIX_FMT_ARGB:
+    case AV_PIX_FMT_ABGR:
+        *plane = 0, *offset = 0, *step = 4;
+        return true;
+    case AV_PIX_FMT_YUVA420P:
+    case AV_PIX_FMT_YUVA422P:
+    case AV_PIX_FMT_YUVA444P:
+    case AV_PIX_FMT_GBRAP:
+        *plane = 3, *offset = 0, *step = 1;
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool findAlphaBox(const AVFrame *frame, AlphaBox *box) {
+    int plane, offset, step;
+    *box = (AlphaBox){ 0, 0, frame->width, frame->height, false };
+    if (!alphaLayout(frame, &plane, &offset, &step)) {
+        return false;
+    }
+
+    int left = frame->width, right = -1, top = -1, bottom = -1;
+    int64_t opaque_pixels = 0;
+    for (int y = 0; y < frame->height; y++) {
+        const uint8_t *alpha = frame->data[plane] + (ptrdiff_t)y * frame->linesize[plane] + offset;
+        int first = -1, last = -1;
+        for (int x = 0; x < frame->width; x++) {
+            uint8_t a = alpha[x * step];
+            if (a) {
+                if (first < 0)
+                    first = x;
+                last = x;
+                opaque_pixels += a == 255;
+            }
+        }
+        if (first < 0) {
+            continue;
+        }
+        if (top < 0)
+            top = y;
+        bottom = y;
+        left = FFMIN(left, first);
+        right = FFMAX(right, last);
+    }
+
+    if (top < 0) {
+        *box = (AlphaBox){ 0, 0, 0, 0, false };
+        return true;
+    }
+    box->x = left;
+    box->y = top;
+    box->width = right - left + 1;
+    box->height = bottom - top + 1;
+    // Every opaque pixel lies in the box, so it is all opaque if they fill it
+    box->opaque = opaque_pixels == (int64_t)box->width * box->height;
+    return true;
+}
@@ -0,0 +1,37 @@
+#include <libavutil/frame.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Wayland's ARGB8888 carries premultiplied alpha, decoders and swscale
+// produce straight alpha. These kernels premultiply BGRA in place, with
+// exact rounding so that every kernel gives the same bytes.
+
+typedef void (*PremultiplyRowFunc)(uint8_t *row, int width);
+
+typedef struct {
+    const char *name;
+    PremultiplyRowFunc row;
+} PremultiplyKernel;
+
+// The fastest kernel this CPU supports
+const PremultiplyKernel *bestPremultiplyKernel(void);
+// Every kernel this CPU supports, starting with the scalar reference
+const PremultiplyKernel *const *supportedPremultiplyKernels(int *count);
+
+void premultiplyRows(const PremultiplyKernel *kernel, uint8_t *data, int stride, int width,
+                     int y_start, int y_end);
+
+// The part of a frame that isn't fully transparent, empty when none is.
+// opaque is set when every pixel in it is fully opaque.
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+    bool opaque;
+} AlphaBox;
+
+// Finds the box from the frame's alpha channel. Returns false, with the
+// whole frame as the box, for formats without an 8-bit alpha channel to
+// read.
+bool findAlphaBox(const AVFrame *frame, AlphaBox *box);
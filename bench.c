@@ -0,0 +1,409 @@
+#include "bench.h"
+#include "convert.h"
+#include "ffmpeg.h"
+#include <libavutil/cpu.h>
+#include <libavutil/pixdesc.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SYNTHETIC_WIDTH 3840
+#define SYNTHETIC_HEIGHT 2160
+#define BENCH_SECONDS 0.5
+// Enough frames to get past decoder warm-up without decoding a whole clip
+#define BENCH_DECODE_FRAMES 300
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static AVFrame *syntheticFrame(enum AVPixelFormat format, int width, int height) {
+    AVFrame *frame = av_frame_alloc();
+    if (!frame) {
+        return NULL;
+    }
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    if (av_frame_get_buffer(frame, 64) < 0) {
+        fprintf(stderr, "Could not allocate a %dx%d test frame\n", width, height);
+        av_frame_free(&frame);
+        return NULL;
+    }
+
+    // Noise rather than a gradient so that every clamp gets exercised
+    srand(1);
+    for (int plane = 0; plane < 3 && frame->data[plane]; plane++) {
+        int rows = plane == 0 ? height : (height + 1) / 2;
+        for (int i = 0; i < rows * frame->linesize[plane]; i++) {
+            frame->data[plane][i] = rand();
+        }
+    }
+    return frame;
+}
+
+// Largest per-channel difference between dst and a double precision
+// conversion of the same frame
+static int referenceError(const AVFrame *frame, bool nv12, YuvMatrix matrix, bool full_range,
+                          const uint8_t *dst, int dst_stride, int width) {
+    double kr = matrix == YUV_MATRIX_BT709 ? 0.2126 : 0.299;
+    double kb = matrix == YUV_MATRIX_BT709 ? 0.0722 : 0.114;
+    double kg = 1.0 - kr - kb;
+    double y_scale = full_range ? 1.0 : 255.0 / 219.0;
+    double c_scale = full_range ? 1.0 : 255.0 / 224.0;
+    int max_error = 0;
+
+    for (int row = 0; row < frame->height; row++) {
+        const uint8_t *y = frame->data[0] + row * frame->linesize[0];
+        const uint8_t *u = frame->data[1] + (row / 2) * frame->linesize[1];
+        const uint8_t *v = nv12 ? u + 1 : frame->data[2] + (row / 2) * frame->linesize[2];
+        int chroma_step = nv12 ? 2 : 1;
+
+        for (int x = 0; x < width; x++) {
+            double luma = (y[x] - (full_range ? 0 : 16)) * y_scale;
+            double cu = (u[x / 2 * chroma_step] - 128) * c_scale;
+            double cv = (v[x / 2 * chroma_step] - 128) * c_scale;
+            double bgr[3] = {
+                luma + 2.0 * (1.0 - kb) * cu,
+                luma - 2.0 * (1.0 - kb) * kb / kg * cu - 2.0 * (1.0 - kr) * kr / kg * cv,
+                luma + 2.0 * (1.0 - kr) * cv,
+            };
+            for (int c = 0; c < 3; c++) {
+                int expected = lrint(fmin(255.0, fmax(0.0, bgr[c])));
+                int error = abs(expected - dst[row * dst_stride + x * 4 + c]);
+                max_error = FFMAX(max_error, error);
+            }
+        }
+    }
+    return max_error;
+}
+
+// Every kernel must match the scalar path bit for bit, for each matrix and
+// range, at the full width and at one pixel less to cover the scalar tails
+static int checkParity(const AVFrame *frame, bool nv12) {
+    int count;
+    const YuvKernel *const *kernels = supportedYuvKernels(&count);
+    int dst_stride = FFALIGN(frame->width * 4, 64);
+    uint8_t *expected = av_malloc((size_t)dst_stride * frame->height);
+    uint8_t *actual = av_malloc((size_t)dst_stride * frame->height);
+    int failures = 0;
+
+    if (!expected || !actual) {
+        fprintf(stderr, "Could not allocate conversion buffers\n");
+        av_free(expected);
+        av_free(actual);
+        return -1;
+    }
+
+    for (int matrix = YUV_MATRIX_BT601; matrix <= YUV_MATRIX_BT709; matrix++) {
+        for (int full_range = 0; full_range <= 1; full_range++) {
+            YuvCoeffs coeffs;
+            initYuvCoeffs(&coeffs, matrix, full_range);
+
+            for (int width = frame->width; width >= frame->width - 1 && width > 0; width--) {
+                convertYuvRows(kernels[0], nv12, (const uint8_t *const *)frame->data, frame->linesize,
+                               expected, dst_stride, width, 0, frame->height, &coeffs);
+                if (width == frame->width) {
+                    printf("  %s %s range: max error %d against floating point\n",
+                           matrix == YUV_MATRIX_BT709 ? "BT.709" : "BT.601",
+                           full_range ? "full" : "limited",
+                           referenceError(frame, nv12, matrix, full_range, expected, dst_stride, width));
+                }
+
+                for (int i = 1; i < count; i++) {
+                    memset(actual, 0, (size_t)dst_stride * frame->height);
+                    convertYuvRows(kernels[i], nv12, (const uint8_t *const *)frame->data, frame->linesize,
+                                   actual, dst_stride, width, 0, frame->height, &coeffs);
+                    for (int row = 0; row < frame->height; row++) {
+                        if (memcmp(expected + row * dst_stride, actual + row * dst_stride, width * 4) != 0) {
+                            printf("  MISMATCH: %s differs from scalar at row %d, width %d\n",
+                                   kernels[i]->name, row, width);
+                            failures++;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    av_free(expected);
+    av_free(actual);
+    return failures > 0 ? -1 : 0;
+}
+
+// Returns Gpixel/s, or 0 if the path is not available
+static double benchPath(Converter *conv, const char *name, int threads, const AVFrame *frame,
+                        uint8_t *dst, int dst_stride) {
+    uint8_t *const dst_planes[4] = { dst, NULL, NULL, NULL };
+    const int dst_linesize[4] = { dst_stride, 0, 0, 0 };
+
+    if (selectConverterPath(conv, name) < 0) {
+        return 0;
+    }
+    conv->threads = threads;
+    // The first call pays for the worker pool and swscale contexts
+    convertFrame(conv, frame, dst_planes, dst_linesize, frame->width, frame->height, AV_PIX_FMT_BGRA);
+
+    int iterations = 0;
+    double start = now_seconds();
+    double elapsed;
+    do {
+        convertFrame(conv, frame, dst_planes, dst_linesize, frame->width, frame->height, AV_PIX_FMT_BGRA);
+        iterations++;
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    double gpixels = (double)frame->width * frame->height * iterations / elapsed / 1e9;
+    printf("  %-8s %2d thread(s) %2d band(s) %8.3f ms/frame %7.3f Gpixel/s\n",
+           conv->path, threads, conv->bands, elapsed * 1e3 / iterations, gpixels);
+    return gpixels;
+}
+
+// Thread counts 1, 2, 4, ... up to and including the number of CPUs
+static void benchScaling(Converter *conv, const char *name, const AVFrame *frame,
+                         uint8_t *dst, int dst_stride) {
+    int cpus = FFMIN(av_cpu_count(), CONVERT_MAX_THREADS);
+    double single = 0;
+
+    for (int threads = 1;; threads = FFMIN(threads * 2, cpus)) {
+        double gpixels = benchPath(conv, name, threads, frame, dst, dst_stride);
+        if (threads == 1) {
+            single = gpixels;
+        } else if (single > 0) {
+            printf("  %-8s speedup %.2fx, %.0f%% parallel efficiency\n", "",
+                   gpixels / single, gpixels / single / threads * 100);
+        }
+        if (threads >= cpus) {
+            break;
+        }
+    }
+}
+
+static int benchFrame(const AVFrame *frame, const char *label) {
+    bool nv12 = frame->format == AV_PIX_FMT_NV12;
+    bool supported = nv12 || frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUVJ420P;
+    int ret = 0;
+
+    printf("%s: %dx%d %s\n", label, frame->width, frame->height,
+           av_get_pix_fmt_name(frame->format));
+
+    if (supported) {
+        printf(" parity:\n");
+        ret = checkParity(frame, nv12);
+        printf("  %s\n", ret < 0 ? "FAILED" : "all kernels match the scalar reference");
+    } else {
+        printf(" no hand-written kernel for this format, only swscale applies\n");
+    }
+
+    int dst_stride = FFALIGN(frame->width * 4, 64);
+    uint8_t *dst = av_malloc((size_t)dst_stride * frame->height);
+    if (!dst) {
+        fprintf(stderr, "Could not allocate conversion buffer\n");
+        return -1;
+    }
+
+    printf(" conversion to BGRA, single threaded:\n");
+    Converter conv = { 0 };
+    benchPath(&conv, "swscale", 1, frame, dst, dst_stride);
+    if (supported) {
+        int count;
+        const YuvKernel *const *kernels = supportedYuvKernels(&count);
+        for (int i = 0; i < count; i++) {
+            benchPath(&conv, kernels[i]->name, 1, frame, dst, dst_stride);
+        }
+    }
+
+    printf(" slice-parallel scaling on %d CPU(s):\n", av_cpu_count());
+    benchScaling(&conv, "swscale", frame, dst, dst_stride);
+    if (supported) {
+        benchScaling(&conv, bestYuvKernel()->name, frame, dst, dst_stride);
+    }
+    freeConverter(&conv);
+    av_free(dst);
+    return ret;
+}
+
+// Every premultiply kernel must match the scalar one bit for bit, and that
+// must match round(c * a / 255), at the full width and at one pixel less
+// to cover the tails. Then the throughput of each, single threaded. frame
+// is straight alpha BGRA.
+static int benchPremultiply(const AVFrame *frame, const char *label) {
+    size_t size = (size_t)frame->linesize[0] * frame->height;
+    uint8_t *expected = av_malloc(size);
+    uint8_t *actual = av_malloc(size);
+    int count;
+    const PremultiplyKernel *const *kernels = supportedPremultiplyKernels(&count);
+    int failures = 0;
+
+    if (!expected || !actual) {
+        fprintf(stderr, "Could not allocate premultiply buffers\n");
+        av_free(expected);
+        av_free(actual);
+        return -1;
+    }
+
+    printf("%s: %dx%d bgra premultiply\n parity:\n", label, frame->width, frame->height);
+    for (int width = frame->width; width >= frame->width - 1; width--) {
+        memcpy(expected, frame->data[0], size);
+        premultiplyRows(kernels[0], expected, frame->linesize[0], width, 0, frame->height);
+        for (int row = 0; row < frame->height && failures == 0; row++) {
+            const uint8_t *src = frame->data[0] + row * frame->linesize[0];
+            const uint8_t *dst = expected + row * frame->linesize[0];
+            for (int x = 0; x < width * 4; x++) {
+                int a = src[x | 3];
+                int want = (x & 3) == 3 ? a : (int)lrint(src[x] * a / 255.0);
+                if (dst[x] != want) {
+                    printf("  MISMATCH: scalar differs from the reference at row %d\n", row);
+                    failures++;
+                    break;
+                }
+            }
+        }
+
+        for (int i = 1; i < count; i++) {
+            memcpy(actual, frame->data[0], size);
+            premultiplyRows(kernels[i], actual, frame->linesize[0], width, 0, frame->height);
+            if (memcmp(expected, actual, size) != 0) {
+                printf("  MISMATCH: %s differs from scalar at width %d\n", kernels[i]->name, width);
+                failures++;
+            }
+        }
+    }
+    printf("  %s\n", failures ? "FAILED" : "all kernels match the scalar reference");
+
+    printf(" premultiply in place, single threaded:\n");
+    for (int i = 0; i < count; i++) {
+        // Every kernel starts from the same straight alpha frame
+        memcpy(actual, frame->data[0], size);
+        int iterations = 0;
+        double start = now_seconds();
+        double elapsed;
+        do {
+            premultiplyRows(kernels[i], actual, frame->linesize[0], frame->width, 0, frame->height);
+            iterations++;
+            elapsed = now_seconds() - start;
+        } while (elapsed < BENCH_SECONDS);
+        printf("  %-8s %8.3f ms/frame %7.3f Gpixel/s\n", kernels[i]->name, elapsed * 1e3 / iterations,
+               (double)frame->width * frame->height * iterations / elapsed / 1e9);
+    }
+
+    av_free(expected);
+    av_free(actual);
+    return failures ? -1 : 0;
+}
+
+// The premultiply check on the alpha of a decoded frame, as the display
+// path sees it: converted to straight alpha BGRA first. Frames without
+// alpha are skipped, the synthetic check still covers the kernels.
+static int benchDecodedPremultiply(const AVFrame *frame, const char *label) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    if (!desc || !(desc->flags & AV_PIX_FMT_FLAG_ALPHA)) {
+        printf("%s: no alpha channel, premultiply only checked on synthetic data\n", label);
+        return 0;
+    }
+
+    Converter conv = { 0 };
+    AVFrame *straight = convertToFrame(&conv, frame, AV_PIX_FMT_BGRA);
+    freeConverter(&conv);
+    if (!straight) {
+        fprintf(stderr, "Could not convert %s to BGRA\n", label);
+        return -1;
+    }
+    int ret = benchPremultiply(straight, label);
+    av_frame_free(&straight);
+    return ret;
+}
+
+static int benchSyntheticPremultiply(void) {
+    AVFrame *frame = syntheticFrame(AV_PIX_FMT_BGRA, SYNTHETIC_WIDTH, SYNTHETIC_HEIGHT);
+    if (!frame) {
+        return -1;
+    }
+    int ret = benchPremultiply(frame, "synthetic");
+    av_frame_free(&frame);
+    return ret;
+}
+
+// Decode throughput of the start of the clip under one threading setting
+static int benchDecode(const char *inputfile, const char *spec) {
+    DecoderThreading threading;
+    parseDecoderThreading(spec, &threading);
+
+    VideoDecoder *decoder = openDecoder(inputfile, &threading);
+    if (!decoder) {
+        return -1;
+    }
+    AVFrame *frame = av_frame_alloc();
+    double pixels = 0;
+    int frames = 0;
+    while (frames < BENCH_DECODE_FRAMES && decodeNextFrame(decoder, frame) >= 0) {
+        pixels += (double)frame->width * frame->height;
+        frames++;
+        av_frame_unref(frame);
+    }
+
+    double seconds = atomic_load(&decoder->stats.decode_ns) / 1e9;
+    printf("  %-8s %s threading with %2d thread(s): %4d frames %8.1f fps %8.1f Mpixel/s\n",
+           spec, threadTypeName(decoder->stats.thread_type), decoder->stats.thread_count,
+           frames, decodeFps(&decoder->stats), seconds > 0 ? pixels / seconds / 1e6 : 0);
+
+    av_frame_free(&frame);
+    closeDecoder(&decoder);
+    return 0;
+}
+
+int runBenchmark(const char *inputfile) {
+    int ret = 0;
+
+    printf("best kernel on this CPU: %s\n", bestYuvKernel()->name);
+
+    if (inputfile) {
+        const char *const settings[] = { "1", "slice", "frame", "auto" };
+        printf("%s: decoding\n", inputfile);
+        for (size_t i = 0; i < sizeof(settings) / sizeof(settings[0]); i++) {
+            if (benchDecode(inputfile, settings[i]) < 0) {
+                return -1;
+            }
+        }
+
+        VideoDecoder *decoder = openDecoder(inputfile, NULL);
+        if (!decoder) {
+            return -1;
+        }
+        AVFrame *frame = av_frame_alloc();
+        if (!frame || decodeNextFrame(decoder, frame) < 0) {
+            fprintf(stderr, "Could not decode a frame from %s\n", inputfile);
+            av_frame_free(&frame);
+            closeDecoder(&decoder);
+            return -1;
+        }
+        ret = benchFrame(frame, inputfile);
+        if (benchDecodedPremultiply(frame, inputfile) < 0 || benchSyntheticPremultiply() < 0) {
+            ret = -1;
+        }
+        av_frame_free(&frame);
+        closeDecoder(&decoder);
+        return ret;
+    }
+
+    const enum AVPixelFormat formats[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12 };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        AVFrame *frame = syntheticFrame(formats[i], SYNTHETIC_WIDTH, SYNTHETIC_HEIGHT);
+        if (!frame) {
+            return -1;
+        }
+        if (benchFrame(frame, "synthetic") < 0) {
+            ret = -1;
+        }
+        av_frame_free(&frame);
+    }
+    if (benchSyntheticPremultiply() < 0) {
+        ret = -1;
+    }
+    return ret;
+}
@@ -0,0 +1,6 @@
+// Offline checks run with --bench instead of opening a window: decode
+// throughput under each threading setting (only with a video), parity of
+// every conversion kernel against the scalar reference, then conversion
+// throughput. Uses the first frame of inputfile, or synthetic 4K frames
+// when NULL. Returns -1 if any kernel disagrees with the reference.
+int runBenchmark(const char *inputfile);
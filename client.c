@@ -1,65 +1,55 @@
 #define _POSIX_C_SOURCE 200112L
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
 #include <assert.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
 #include <xkbcommon/xkbcommon.h>
 #include <wayland-client.h>
 #include "xdg-shell-client-protocol.h"
 #include "ffmpeg.h"
+#include "damage.h"
+#include "framestore.h"
+#include "convert.h"
+#include "shm.h"
+#include "diskcache.h"
+#include "bench.h"
 
 
-/* Shared memory support code */
-static void
-randname(char *buf)
-{
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    long r = ts.tv_nsec;
-    for (int i = 0; i < 6; ++i) {
-        buf[i] = 'A'+(r&15)+(r&16)*2;
-        r >>= 5;
-    }
-}
+/* Playback statistics, reported every STATS_INTERVAL seconds with --stats */
+/* Damage of this many frames back is kept, for buffers that come back
+ * holding an older frame */
+#define DAMAGE_HISTORY 8
+#define STATS_INTERVAL 5.0
+/* How often to look again for a frame the store hasn't decoded yet */
+#define STORE_RETRY_INTERVAL 0.002
 
-static int
-create_shm_file(void)
-{
-    int retries = 100;
-    do {
-        char name[] = "/wl_shm-XXXXXX";
-        randname(name + sizeof(name) - 7);
-        --retries;
-        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
-        if (fd >= 0) {
-            shm_unlink(name);
-            return fd;
-        }
-    } while (retries > 0 && errno == EEXIST);
-    return -1;
-}
+struct playback_stats {
+    unsigned long frames_presented;
+    unsigned long frames_dropped;   /* Skipped to catch up with the clock */
+    unsigned long frames_late;      /* Went up over half a frame late */
+    unsigned long frames_repeated;  /* Due, but the old frame stayed up */
+    unsigned long underruns;
+    double damaged;      /* Pixels damaged, summed over the frames presented */
+    double drift_last;   /* How late the last frame went up, in seconds */
+    double drift_total;
+    double drift_max;
+    struct timespec last_report;
+};
 
-static int
-allocate_shm_file(size_t size)
-{
-    int fd = create_shm_file();
-    if (fd < 0)
-        return -1;
-    int ret;
-    do {
-        ret = ftruncate(fd, size);
-    } while (ret < 0 && errno == EINTR);
-    if (ret < 0) {
-        close(fd);
-        return -1;
-    }
-    return fd;
-}
+/* What to do when frames can't be shown as fast as they are due */
+enum drop_policy {
+    DROP_CATCH_UP,    /* Skip frames to stay on the media clock */
+    DROP_NEVER,       /* Show every frame, back to back until caught up */
+    DROP_SLOW_MOTION, /* Show every frame, letting the clock fall back */
+};
 
 /* Wayland code */
 struct client_state {
@@ -67,16 +57,29 @@ struct client_state {
     struct wl_display *wl_display;
     struct wl_registry *wl_registry;
     struct wl_shm *wl_shm;
+    struct wl_array shm_formats;    // Advertised by wl_shm.format
+    atomic_bool shm_formats_ready;  // Complete, for the decode thread to read
     struct wl_compositor *wl_compositor;
     struct xdg_wm_base *xdg_wm_base;
+    struct wl_subcompositor *wl_subcompositor;
     struct wl_seat *wl_seat;
     /* Objects */
-    struct wl_surface *wl_surface;
+    struct wl_surface *wl_surface;          // Transparent canvas, the toplevel
+    struct wl_buffer *canvas_buffer;
+    struct wl_surface *video_surface;       // The video, a subsurface of it
+    struct wl_subsurface *video_subsurface;
+    bool video_mapped;
     struct xdg_surface *xdg_surface;
     struct xdg_toplevel *xdg_toplevel;
     struct wl_keyboard *wl_keyboard;
-    int height;
+    struct wl_output *wl_output;
+    int height;             // Canvas size
     int width;
+    int configured_width;   // Size asked for by the compositor, 0 if ours to pick
+    int configured_height;
+    int output_width;       // Current mode of the output
+    int output_height;
+    bool closed;
     //state
     struct xkb_state *xkb_state;
     struct xkb_context *xkb_context;
@@ -87,80 +90,889 @@ struct client_state {
     int img_y;
     int img_width;
     int img_height;
+    bool opaque;                     // The video has no alpha channel
+    uint32_t rgb_format;             // Packed RGB shm format, XRGB8888 when opaque
+    AlphaBox *frame_boxes;           // Visible part of each cached frame, NULL if unknown
+    AlphaBox shown_box;              // Visible part of the frame on screen
+    bool shown_box_valid;
+    FrameDamage *frame_damage;       // Change from the frame before, per cached frame
+    AVFrame *shown_frame;            // Frame on screen, to compare the next against
+    int shown_index;                 // Cached frame on screen
+    FrameDamage damage;              // Change from the frame on screen to the next
+    FrameDamage damage_history[DAMAGE_HISTORY]; // Indexed by frame_seq
+    unsigned long frame_seq;         // Frames shown so far
+    DecoderThreading decoder_threading;
     FrameArray frame_array;
+    bool keep_argb;                  // frame_array holds converted frames, not decoded ones
+    bool streaming;
+    int ring_size;
+    bool cache_packets;              // Stream from the compressed clip in memory
+    FrameRing frame_ring;
+    struct decode_pool decode_pool;  // Streamed frames decoded straight into shm
+    Converter copy_converter;        // Premultiplies alpha into decode pool slots
+    bool preload;
+    struct preloaded_frames preloaded;
+    const char *cache_dir;           // Keep preloaded frames on disk here
+    struct disk_cache disk_cache;
+    bool cache_hit;                  // Frames come from disk_cache, nothing is decoded
+    size_t store_budget;             // Bytes of decoded frames kept, 0 keeps them all
+    int store_ahead;
+    FrameStore frame_store;
+    Converter converter;
+    struct buffer_pool buffer_pool;
     struct timespec last_frame_time;
-    double frame_duration; // In seconds
+    int timer_fd;                    // Fires when the next frame is due
+    struct wl_callback *frame_callback; // Pending until the compositor is ready
+    /* Media clock, all times in seconds of video time */
+    AVRational time_base;
+    struct timespec clock_start; // When media time 0 was on screen
+    double clip_duration;        // Length of one loop (cached modes)
+    double *frame_times;         // Presentation time of each cached frame
+    double current_time;         // When the current frame was due
+    double next_time;            // When the next frame is due
+    bool stalled;                // Next frame is due but not decoded yet
+    bool store_waiting;          // Same for the frame store, retried by the timer
+    enum drop_policy drop_policy;
+    long current_loop;
     int current_frame;     // Index of the current frame
+    bool show_stats;
+    struct playback_stats stats;
 };
 
+static double
+timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
 static void
-wl_buffer_release(void *data, struct wl_buffer *wl_buffer)
+timespec_add(struct timespec *ts, double seconds)
 {
-    /* Sent by the compositor when it's no longer using this buffer */
-    wl_buffer_destroy(wl_buffer);
+    long nsec = ts->tv_nsec + (long)(seconds * 1e9);
+    ts->tv_sec += nsec / 1000000000;
+    ts->tv_nsec = nsec % 1000000000;
+    if (ts->tv_nsec < 0) {
+        ts->tv_nsec += 1000000000;
+        ts->tv_sec--;
+    }
 }
 
-static const struct wl_buffer_listener wl_buffer_listener = {
-    .release = wl_buffer_release,
-};
+static void
+print_stats(struct client_state *state)
+{
+    fprintf(stderr, "frames presented: %lu, dropped: %lu, late: %lu, repeated: %lu\n",
+            state->stats.frames_presented, state->stats.frames_dropped,
+            state->stats.frames_late, state->stats.frames_repeated);
+    if (state->streaming) {
+        fprintf(stderr, "  decode queue depth: %d/%d, underruns: %lu\n",
+                frameRingDepth(&state->frame_ring), state->frame_ring.size,
+                state->stats.underruns);
+        if (state->decode_pool.data) {
+            fprintf(stderr, "  decoded into shm: %lu, decoded elsewhere (all slots busy): %lu\n",
+                    state->decode_pool.frames, state->decode_pool.all_busy);
+        }
+    }
+    if (state->stats.frames_presented > 0) {
+        fprintf(stderr, "  damage: %.1f%% of the frame on average\n",
+                state->stats.damaged * 100 / state->stats.frames_presented /
+                ((double)state->img_width * state->img_height));
+        fprintf(stderr, "  clock drift: %.2f ms now, %.2f ms mean, %.2f ms max\n",
+                state->stats.drift_last * 1e3,
+                state->stats.drift_total * 1e3 / state->stats.frames_presented,
+                state->stats.drift_max * 1e3);
+    }
 
-static struct wl_buffer *
-draw_frame(struct client_state *state, int frame_num)
+    const DecodeStats *decode = state->streaming ? &state->frame_ring.decoder->stats :
+        state->store_budget ? &state->frame_store.decoder->stats : &state->frame_array.decode_stats;
+    if (decode->codec) {
+        fprintf(stderr, "  decode: %s, %s threading with %d thread(s), %.1f fps\n",
+                decode->codec, threadTypeName(decode->thread_type), decode->thread_count,
+                decodeFps(decode));
+    }
+
+    if (state->store_budget) {
+        FrameStoreStats store;
+        size_t bytes;
+        frameStoreStats(&state->frame_store, &store, &bytes);
+        unsigned long lookups = store.hits + store.misses;
+        fprintf(stderr, "  frame store: %.1f%% hits, %lu misses, %lu evictions, %lu re-decoded, "
+                "%lu seeks, %.3f ms/frame decoding, %zu/%zu MiB\n",
+                lookups ? store.hits * 100.0 / lookups : 100.0, store.misses, store.evictions,
+                store.redecoded, store.seeks,
+                store.decoded ? store.decode_time * 1e3 / store.decoded : 0.0,
+                bytes >> 20, state->store_budget >> 20);
+    }
+
+    const Converter *conv = &state->converter;
+    if (conv->frame_count > 0) {
+        fprintf(stderr, "  conversion: %.3f ms/frame (%s, %d band(s)), %lu init(s) taking %.3f ms\n",
+                conv->convert_time * 1e3 / conv->frame_count, conv->path, conv->bands,
+                conv->init_count, conv->init_time * 1e3);
+    }
+
+    const struct buffer_pool *pool = &state->buffer_pool;
+    fprintf(stderr, "  shm buffers: %d, grown: %lu, frames skipped (all busy): %lu\n",
+            pool->count, pool->grown, pool->exhausted);
+}
+
+static int
+get_frame_count(struct client_state *state)
 {
-    int width = state->width;
-    int height = state->height;
-    int stride = width * 4;
-    int size = stride * height;
+    if (state->preload)
+        return state->preloaded.count;
+    if (state->store_budget)
+        return state->frame_store.frame_count;
+    return state->frame_array.frame_count;
+}
 
-    int fd = allocate_shm_file(size);
-    if (fd == -1) {
-        return NULL;
+static AVFrame *
+get_current_frame(struct client_state *state)
+{
+    if (state->streaming)
+        return frameRingFront(&state->frame_ring);
+    if (state->store_budget)
+        return frameStoreGet(&state->frame_store, state->current_frame);
+    return state->frame_array.frames[state->current_frame];
+}
+
+/* Opaque packed RGB a decoder can write that wl_shm takes as it is. Not
+ * straight alpha: ARGB8888 is premultiplied, and premultiplying in place
+ * would spoil the frames the codec refers back to, see copy_out_frame(). */
+static bool
+shm_format_for(enum AVPixelFormat format, uint32_t *shm_format)
+{
+    switch (format) {
+    case AV_PIX_FMT_BGR0:
+        *shm_format = WL_SHM_FORMAT_XRGB8888;
+        return true;
+    case AV_PIX_FMT_RGB0:
+        *shm_format = WL_SHM_FORMAT_XBGR8888;
+        return true;
+    case AV_PIX_FMT_0RGB:
+        *shm_format = WL_SHM_FORMAT_BGRX8888;
+        return true;
+    case AV_PIX_FMT_0BGR:
+        *shm_format = WL_SHM_FORMAT_RGBX8888;
+        return true;
+    case AV_PIX_FMT_RGB24:
+        *shm_format = WL_SHM_FORMAT_BGR888;
+        return true;
+    case AV_PIX_FMT_BGR24:
+        *shm_format = WL_SHM_FORMAT_RGB888;
+        return true;
+    default:
+        return false;
     }
+}
 
-    uint32_t *data = mmap(NULL, size,
-            PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (data == MAP_FAILED) {
-        close(fd);
-        return NULL;
+static bool shm_format_supported(struct client_state *state, uint32_t format);
+
+/* Whether the decode thread can hand frames in format to the compositor as
+ * they are. Beyond XRGB8888 that is only known once wl_shm has listed its
+ * formats; frames decoded before then are converted. */
+static bool
+decode_format_usable(struct client_state *state, enum AVPixelFormat format,
+        uint32_t *shm_format)
+{
+    if (!shm_format_for(format, shm_format))
+        return false;
+    if (*shm_format == WL_SHM_FORMAT_XRGB8888)
+        return true;
+    return atomic_load_explicit(&state->shm_formats_ready, memory_order_acquire) &&
+        shm_format_supported(state, *shm_format);
+}
+
+static void
+release_decode_slot(void *opaque, uint8_t *data)
+{
+    decode_slot_done(opaque);
+}
+
+/* AVCodecContext.get_buffer2 for streaming: codecs that output opaque
+ * packed RGB get a slot of the decode pool, so their frames can be
+ * attached as they are. Everything else, and everything once the slots run
+ * out, gets a buffer of libavcodec's own and is converted as usual. Runs on
+ * the decode thread(s). */
+static int
+get_decode_buffer(AVCodecContext *ctx, AVFrame *frame, int flags)
+{
+    struct client_state *state = ctx->opaque;
+    uint32_t format;
+
+    if (!(ctx->codec->capabilities & AV_CODEC_CAP_DR1) ||
+            !decode_format_usable(state, frame->format, &format))
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+
+    /* Leave room for what the codec may write past the visible frame.
+     * Here frame->width and height are still the coded size, which may
+     * be larger; the buffer shown is only the visible size. */
+    int width = frame->width;
+    int rows = frame->height;
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(ctx, &width, &rows, linesize_align);
+    int stride = FFALIGN(av_image_get_linesize(frame->format, width, 0), 64);
+
+    struct decode_slot *slot = decode_pool_acquire(&state->decode_pool,
+            ctx->width, ctx->height, rows, stride, format);
+    if (!slot)
+        return avcodec_default_get_buffer2(ctx, frame, flags);
+
+    frame->buf[0] = av_buffer_create(slot->data, (size_t)stride * rows,
+            release_decode_slot, slot, 0);
+    if (!frame->buf[0]) {
+        decode_slot_done(slot);
+        return AVERROR(ENOMEM);
     }
+    frame->data[0] = slot->data;
+    frame->linesize[0] = stride;
+    return 0;
+}
 
-    struct wl_shm_pool *pool = wl_shm_create_pool(state->wl_shm, fd, size);
-    struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0,
-            width, height, stride, WL_SHM_FORMAT_ARGB8888);
-    wl_shm_pool_destroy(pool);
-    close(fd);
-    
-    /* Draw checkerboxed background 
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            if ((x + y / 8 * 8) % 16 < 8)
-                data[y * width + x] = 0xFF666666;
-            else
-                data[y * width + x] = 0xFFEEEEEE;
+/* DecoderBuffers.finish_frame for streaming: frames with alpha are
+ * converted to premultiplied ARGB8888 in a slot of the decode pool, here
+ * on the decode thread, and take the place of the decoded frame. The
+ * display thread then only attaches them. Without a free slot the frame
+ * stays as it is and is converted at display. */
+static void
+copy_out_frame(void *opaque, AVFrame *frame)
+{
+    struct client_state *state = opaque;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    if (!desc || !(desc->flags & AV_PIX_FMT_FLAG_ALPHA))
+        return;
+
+    int stride = FFALIGN(frame->width * 4, 64);
+    struct decode_slot *slot = decode_pool_acquire(&state->decode_pool,
+            frame->width, frame->height, frame->height, stride, WL_SHM_FORMAT_ARGB8888);
+    if (!slot)
+        return;
+
+    AVFrame *copy = av_frame_alloc();
+    AVBufferRef *buf = copy ? av_buffer_create(slot->data, (size_t)stride * frame->height,
+            release_decode_slot, slot, 0) : NULL;
+    if (!buf) {
+        av_frame_free(&copy);
+        decode_slot_done(slot);
+        return;
+    }
+    copy->buf[0] = buf;
+    copy->data[0] = slot->data;
+    copy->linesize[0] = stride;
+    copy->format = AV_PIX_FMT_BGRA;
+    copy->width = frame->width;
+    copy->height = frame->height;
+    /* Freeing the copy gives the slot back */
+    if (av_frame_copy_props(copy, frame) < 0 ||
+            convertFrame(&state->copy_converter, frame, copy->data, copy->linesize,
+                         frame->width, frame->height, AV_PIX_FMT_BGRA) < 0) {
+        av_frame_free(&copy);
+        return;
+    }
+    av_frame_unref(frame);
+    av_frame_move_ref(frame, copy);
+    av_frame_free(&copy);
+}
+
+static bool
+shm_format_supported(struct client_state *state, uint32_t format)
+{
+    /* Every compositor takes these two */
+    if (format == WL_SHM_FORMAT_ARGB8888 || format == WL_SHM_FORMAT_XRGB8888)
+        return true;
+
+    uint32_t *supported;
+    wl_array_for_each(supported, &state->shm_formats) {
+        if (*supported == format)
+            return true;
+    }
+    return false;
+}
+
+/* The wl_shm format to hand frame over in, and the pixel format it has to
+ * be in for that. YUV goes over as it is when the compositor takes it.
+ * wl_shm can't say which matrix or range YUV is in and compositors assume
+ * limited range BT.601, so only content in that (or untagged, which we
+ * treat the same) can; the rest is converted to ARGB8888 here. */
+static uint32_t
+select_shm_format(struct client_state *state, const AVFrame *frame,
+        enum AVPixelFormat *pix_fmt)
+{
+    bool bt601 = frame->color_range != AVCOL_RANGE_JPEG &&
+        (frame->colorspace == AVCOL_SPC_UNSPECIFIED ||
+         frame->colorspace == AVCOL_SPC_BT470BG ||
+         frame->colorspace == AVCOL_SPC_SMPTE170M);
+
+    if (bt601 && frame->format == AV_PIX_FMT_YUV420P &&
+            shm_format_supported(state, WL_SHM_FORMAT_YUV420)) {
+        *pix_fmt = AV_PIX_FMT_YUV420P;
+        return WL_SHM_FORMAT_YUV420;
+    }
+    if (bt601 && frame->format == AV_PIX_FMT_NV12 &&
+            shm_format_supported(state, WL_SHM_FORMAT_NV12)) {
+        *pix_fmt = AV_PIX_FMT_NV12;
+        return WL_SHM_FORMAT_NV12;
+    }
+    /* BGRA in memory is Wayland's little-endian ARGB8888 */
+    *pix_fmt = AV_PIX_FMT_BGRA;
+    return state->rgb_format;
+}
+
+/* Copies just the visible part of a premultiplied BGRA frame into a
+ * buffer, and clears what an earlier frame left there outside it */
+static void
+draw_box(struct pool_buffer *buffer, int stride, const AVFrame *frame,
+        const AlphaBox *box)
+{
+    for (int y = buffer->drawn_y; y < buffer->drawn_y + buffer->drawn_height; y++) {
+        uint8_t *row = buffer->data + (size_t)y * stride;
+        int left = buffer->drawn_x;
+        int right = buffer->drawn_x + buffer->drawn_width;
+        if (y < box->y || y >= box->y + box->height || box->width == 0) {
+            memset(row + left * 4, 0, (right - left) * 4);
+            continue;
         }
-    }*/
+        if (left < box->x)
+            memset(row + left * 4, 0, (FFMIN(right, box->x) - left) * 4);
+        if (right > box->x + box->width) {
+            int start = FFMAX(left, box->x + box->width);
+            memset(row + start * 4, 0, (right - start) * 4);
+        }
+    }
+
+    av_image_copy_plane(buffer->data + (size_t)box->y * stride + box->x * 4, stride,
+            frame->data[0] + (size_t)box->y * frame->linesize[0] + box->x * 4,
+            frame->linesize[0], box->width * 4, box->height);
+}
+
+/* What changed between the frame a buffer holds and the one about to go
+ * into it, as long as that is still known */
+static bool
+damage_since(struct client_state *state, const struct pool_buffer *buffer,
+        FrameDamage *damage)
+{
+    if (!buffer->frame_seq || state->frame_seq - buffer->frame_seq >= DAMAGE_HISTORY)
+        return false;
 
-    AVFrame *frame = state->frame_array.frames[frame_num];
+    *damage = state->damage;
+    for (unsigned long seq = buffer->frame_seq + 1; seq <= state->frame_seq; seq++)
+        addFrameDamage(damage, &state->damage_history[seq % DAMAGE_HISTORY]);
+    return !damage->full;
+}
+
+/* Draws frame into a free buffer of the pool. Frames that only need
+ * copying are only copied where they differ from what the buffer holds,
+ * or failing that where they are visible, given box. */
+static struct wl_buffer *
+draw_frame(struct client_state *state, AVFrame *frame, const AlphaBox *box)
+{
     //AVFrame *frame = getFrames(state->img_path);
     if (!frame) {
         fprintf(stderr, "Failed to get frame\n");
-        munmap(data, size);
         return NULL;
     }
 
-    frame = toARGB(frame);
-    for (int y = 0; y < frame->height; y++) {
-        uint32_t *dst_row_start = data + ((state->img_y + y) * width) + state->img_x;
-        uint32_t *src_row_start = (uint32_t *)(frame->data[0] + (y * frame->linesize[0]));
-        memcpy(dst_row_start, src_row_start, frame->width * 4);
+    int width = frame->width;
+    int height = frame->height;
+    enum AVPixelFormat pix_fmt;
+    uint32_t format = select_shm_format(state, frame, &pix_fmt);
+    int stride = format == state->rgb_format ? width * 4 : FFALIGN(width, 64);
+
+    struct buffer_pool *pool = &state->buffer_pool;
+    if (pool->width != width || pool->height != height || pool->format != format) {
+        buffer_pool_finish(pool);
+        if (buffer_pool_init(pool, state->wl_shm, width, height, stride, format) < 0) {
+            return NULL;
+        }
+    }
+
+    /* Every buffer is still held by the compositor: skip this frame */
+    struct pool_buffer *buffer = buffer_pool_acquire(pool);
+    if (!buffer) {
+        return NULL;
+    }
+
+    /* Native YUV, and ARGB frames premultiplied at load, are only copied */
+    uint8_t *dst[4];
+    int dst_linesize[4];
+    FrameDamage damage;
+    bool copy = frame->format == pix_fmt &&
+        !(pix_fmt == AV_PIX_FMT_BGRA && state->converter.premultiply);
+    shm_buffer_planes(format, buffer->data, stride, height, dst, dst_linesize);
+    if (copy && damage_since(state, buffer, &damage)) {
+        copyFrameDamage(dst, dst_linesize, frame, &damage);
+    } else if (copy && box && pix_fmt == AV_PIX_FMT_BGRA) {
+        draw_box(buffer, stride, frame, box);
+    } else if (convertFrame(&state->converter, frame, dst, dst_linesize,
+                     width, height, pix_fmt) < 0) {
+        fprintf(stderr, "Failed to convert frame\n");
+        /* It may be partly overwritten, so what it holds isn't known */
+        buffer->frame_seq = 0;
+        buffer->drawn_x = buffer->drawn_y = 0;
+        buffer->drawn_width = width;
+        buffer->drawn_height = height;
+        buffer->busy = false;
+        return NULL;
+    } else if (!strcmp(state->converter.path, "swscale")) {
+        /* swscale filters across tile borders, so the pixels that change
+         * reach into the tiles around those that differ */
+        dilateFrameDamage(&state->damage, DAMAGE_TILE, width, height);
     }
-    av_frame_free(&frame);
-    munmap(data, size);
 
-    wl_buffer_add_listener(buffer, &wl_buffer_listener, NULL);
+    /* The buffer holds exactly this frame now */
+    buffer->frame_seq = state->frame_seq + 1;
+    if (box) {
+        buffer->drawn_x = box->x;
+        buffer->drawn_y = box->y;
+        buffer->drawn_width = box->width;
+        buffer->drawn_height = box->height;
+    } else {
+        buffer->drawn_x = buffer->drawn_y = 0;
+        buffer->drawn_width = width;
+        buffer->drawn_height = height;
+    }
+
+    return buffer->wl_buffer;
+}
+
+/* Chooses what frame_array keeps: the decoder's frames as they are,
+ * converted at every display, or ARGB converted once here, which only
+ * needs copying. Either way draw_frame() shows them. Reports what each
+ * choice costs in memory and in conversion time per frame. */
+static int
+prepare_frame_array(struct client_state *state)
+{
+    FrameArray *frame_array = &state->frame_array;
+    Converter *conv = &state->converter;
+    AVFrame *first = frame_array->frames[0];
+    const char *native = av_get_pix_fmt_name(first->format);
+    size_t native_bytes = 0;
+    for (int i = 0; i < frame_array->frame_count; i++)
+        native_bytes += frameBytes(frame_array->frames[i]);
+    size_t argb_bytes = (size_t)frame_array->frame_count *
+        (sizeof(AVFrame) + av_image_get_buffer_size(AV_PIX_FMT_BGRA, first->width, first->height, 1));
+
+    if (!state->keep_argb) {
+        /* Time one conversion for the comparison */
+        AVFrame *probe = convertToFrame(conv, first, AV_PIX_FMT_BGRA);
+        double convert_ms = conv->frame_count ? conv->convert_time * 1e3 / conv->frame_count : 0;
+        av_frame_free(&probe);
+        conv->frame_count = 0;
+        conv->convert_time = 0;
+        printf("Keeping %s frames: %zu MiB, converted at every frame (%.2f ms each); "
+               "--frame-format argb would take %zu MiB\n",
+               native, native_bytes >> 20, convert_ms, argb_bytes >> 20);
+        return 0;
+    }
+
+    for (int i = 0; i < frame_array->frame_count; i++) {
+        AVFrame *converted = convertToFrame(conv, frame_array->frames[i], AV_PIX_FMT_BGRA);
+        if (!converted)
+            return -1;
+        av_frame_free(&frame_array->frames[i]);
+        frame_array->frames[i] = converted;
+    }
+    double convert_time = conv->convert_time;
+    /* The frames are premultiplied now and only copied from here on */
+    conv->premultiply = false;
+    /* What playback then costs is counted from here on */
+    conv->frame_count = 0;
+    conv->convert_time = 0;
+    printf("Keeping argb frames: %zu MiB, converted once in %.2f s (%.2f ms each) and only "
+           "copied at display; native %s would take %zu MiB\n",
+           argb_bytes >> 20, convert_time, convert_time * 1e3 / frame_array->frame_count,
+           native, native_bytes >> 20);
+    return 0;
+}
+
+/* Finds the visible part of every decoded frame from its alpha, so that
+ * only that is drawn, damaged and takes input */
+static void
+find_frame_boxes(struct client_state *state)
+{
+    FrameArray *frame_array = &state->frame_array;
+    state->frame_boxes = calloc(frame_array->frame_count, sizeof(AlphaBox));
+    if (!state->frame_boxes)
+        return;
+
+    double visible = 0;
+    for (int i = 0; i < frame_array->frame_count; i++) {
+        AlphaBox *box = &state->frame_boxes[i];
+        findAlphaBox(frame_array->frames[i], box);
+        visible += (double)box->width * box->height;
+    }
+    printf("Visible content covers %.1f%% of the frame on average\n", visible * 100 /
+            ((double)frame_array->frame_count * state->img_width * state->img_height));
+}
+
+static double
+damage_area(struct client_state *state, const FrameDamage *damage)
+{
+    if (damage->full)
+        return (double)state->img_width * state->img_height;
+
+    double area = 0;
+    for (int i = 0; i < damage->count; i++)
+        area += (double)damage->rects[i].width * damage->rects[i].height;
+    return area;
+}
+
+static void
+report_frame_damage(struct client_state *state, int count, double seconds)
+{
+    double damaged = 0;
+    for (int i = 0; i < count; i++)
+        damaged += damage_area(state, &state->frame_damage[i]);
+    printf("Compared consecutive frames in %.2f s: %.1f%% of the frame changes on average\n",
+            seconds, damaged * 100 / count / ((double)state->img_width * state->img_height));
+}
+
+/* Compares every kept frame with the one before it, the first with the
+ * last as playback loops, so that only what changed is copied and damaged */
+static void
+find_frame_damage(struct client_state *state)
+{
+    FrameArray *frame_array = &state->frame_array;
+    int count = frame_array->frame_count;
+    state->frame_damage = calloc(count, sizeof(FrameDamage));
+    if (!state->frame_damage)
+        return;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count; i++) {
+        findFrameDamage(frame_array->frames[(i + count - 1) % count], frame_array->frames[i],
+                &state->frame_damage[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report_frame_damage(state, count, timespec_diff(&end, &start));
+}
+
+/* The same for preloaded frames, while they are mapped */
+static void
+find_preloaded_damage(struct client_state *state)
+{
+    struct preloaded_frames *preloaded = &state->preloaded;
+    int count = preloaded->count;
+    state->frame_damage = calloc(count, sizeof(FrameDamage));
+    if (!state->frame_damage)
+        return;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int linesize[4] = { preloaded->stride };
+    for (int i = 0; i < count; i++) {
+        uint8_t *prev[4] = { preloaded_frame_data(preloaded, (i + count - 1) % count) };
+        uint8_t *next[4] = { preloaded_frame_data(preloaded, i) };
+        findDamage(AV_PIX_FMT_BGRA, preloaded->width, preloaded->height,
+                prev, linesize, next, linesize, &state->frame_damage[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    report_frame_damage(state, count, timespec_diff(&end, &start));
+}
+
+static void
+save_frame_damage(struct disk_cache_frame *frame, const FrameDamage *damage)
+{
+    frame->damage_count = damage->full || damage->count > DISK_CACHE_DAMAGE_RECTS ?
+        -1 : damage->count;
+    for (int i = 0; i < frame->damage_count; i++) {
+        frame->damage[i][0] = damage->rects[i].x;
+        frame->damage[i][1] = damage->rects[i].y;
+        frame->damage[i][2] = damage->rects[i].width;
+        frame->damage[i][3] = damage->rects[i].height;
+    }
+}
+
+static void
+load_frame_damage(const struct disk_cache_frame *frame, FrameDamage *damage)
+{
+    damage->full = frame->damage_count < 0 || frame->damage_count > DAMAGE_MAX_RECTS;
+    damage->count = damage->full ? 0 : frame->damage_count;
+    for (int i = 0; i < damage->count; i++) {
+        damage->rects[i] = (DamageRect){ frame->damage[i][0], frame->damage[i][1],
+            frame->damage[i][2], frame->damage[i][3] };
+    }
+}
+
+/* Starts an on-disk cache and points the preloaded frames at it, so that
+ * they are converted straight into the file */
+static int
+create_frame_cache(struct client_state *state, int width, int height, int stride)
+{
+    FrameArray *frame_array = &state->frame_array;
+    struct disk_cache_header layout = {
+        .width = width,
+        .height = height,
+        .stride = stride,
+        .format = state->rgb_format,
+        .frame_count = frame_array->frame_count,
+        .time_base_num = frame_array->time_base.num,
+        .time_base_den = frame_array->time_base.den,
+        .frame_rate_num = frame_array->frame_rate.num,
+        .frame_rate_den = frame_array->frame_rate.den,
+        .duration = frame_array->duration,
+    };
+    struct disk_cache *cache = &state->disk_cache;
+
+    if (disk_cache_create(cache, state->cache_dir, state->img_path, &layout) < 0)
+        return -1;
+    for (int i = 0; i < frame_array->frame_count; i++) {
+        struct disk_cache_frame *frame = &cache->frames[i];
+        AlphaBox box = { 0, 0, width, height, true };
+        if (state->frame_boxes)
+            box = state->frame_boxes[i];
+        frame->pts = frame_array->frames[i]->pts;
+        frame->duration = frame_array->frames[i]->duration;
+        frame->box_x = box.x;
+        frame->box_y = box.y;
+        frame->box_width = box.width;
+        frame->box_height = box.height;
+        frame->box_opaque = box.opaque;
+        frame->damage_count = -1;
+    }
+
+    if (preloaded_frames_init_fd(&state->preloaded, state->wl_shm, cache->fd,
+                cache->header.data_offset, frame_array->frame_count,
+                width, height, stride, state->rgb_format) < 0) {
+        disk_cache_close(cache);
+        return -1;
+    }
+    if (preloaded_frames_map(&state->preloaded) < 0) {
+        preloaded_frames_finish(&state->preloaded);
+        disk_cache_close(cache);
+        return -1;
+    }
+    return 0;
+}
+
+/* Converts every decoded frame once into its own preloaded wl_buffer and
+ * lets go of the decoded frames. With a cache directory the frames land in
+ * a cache file that later runs use as is. */
+static int
+preload_frames(struct client_state *state)
+{
+    if (state->cache_hit) {
+        const struct disk_cache_header *header = &state->disk_cache.header;
+        int ret = preloaded_frames_init_fd(&state->preloaded, state->wl_shm,
+                state->disk_cache.fd, header->data_offset, header->frame_count,
+                header->width, header->height, header->stride, header->format);
+        if (ret == 0)
+            printf("Mapped %d frames from %s\n", state->preloaded.count, state->disk_cache.path);
+        disk_cache_close(&state->disk_cache);
+        return ret;
+    }
+
+    FrameArray *frame_array = &state->frame_array;
+    int width = frame_array->frames[0]->width;
+    int height = frame_array->frames[0]->height;
+    int stride = width * 4;
+
+    bool caching = state->cache_dir && create_frame_cache(state, width, height, stride) == 0;
+    if (state->cache_dir && !caching)
+        fprintf(stderr, "Not caching the frames on disk this time\n");
+    if (!caching && preloaded_frames_init(&state->preloaded, state->wl_shm,
+                frame_array->frame_count, width, height, stride,
+                state->rgb_format) < 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < frame_array->frame_count; i++) {
+        /* BGRA in memory is Wayland's little-endian ARGB8888 */
+        uint8_t *dst[4] = { preloaded_frame_data(&state->preloaded, i) };
+        int dst_linesize[4] = { stride };
+        if (convertFrame(&state->converter, frame_array->frames[i], dst, dst_linesize,
+                         width, height, AV_PIX_FMT_BGRA) < 0) {
+            preloaded_frames_finish(&state->preloaded);
+            if (caching)
+                disk_cache_close(&state->disk_cache);
+            return -1;
+        }
+    }
+
+    find_preloaded_damage(state);
+    for (int i = 0; caching && state->frame_damage && i < frame_array->frame_count; i++)
+        save_frame_damage(&state->disk_cache.frames[i], &state->frame_damage[i]);
+
+    preloaded_frames_unmap(&state->preloaded);
+    freeFrameArray(frame_array);
+    printf("Preloaded %d frames into %zu MiB of shared memory\n",
+            state->preloaded.count, state->preloaded.size >> 20);
+
+    /* Playback goes on from the file even if it can't be kept */
+    if (caching) {
+        if (disk_cache_commit(&state->disk_cache) == 0)
+            printf("Saved the frames to %s\n", state->disk_cache.path);
+        disk_cache_close(&state->disk_cache);
+    }
+    return 0;
+}
+
+/* Works out what changed between the frame on screen and the current
+ * one: from the table made at load if the one on screen is the frame
+ * before it, else by comparing the two tile by tile */
+static void
+find_damage(struct client_state *state, const AVFrame *frame)
+{
+    FrameDamage *damage = &state->damage;
+    damage->full = true;
+    damage->count = 0;
+    if (state->frame_seq == 0)
+        return;
+
+    if (state->frame_damage) {
+        if ((state->shown_index + 1) % get_frame_count(state) == state->current_frame)
+            *damage = state->frame_damage[state->current_frame];
+        return;
+    }
+    /* The store may evict the frame on screen, so it isn't held on to */
+    if (frame && state->store_budget)
+        frameStoreDamage(&state->frame_store, state->shown_index, frame, damage);
+    else if (frame && state->shown_frame)
+        findFrameDamage(state->shown_frame, frame, damage);
+}
+
+/* Returns the buffer holding the current frame, ready to attach */
+static struct wl_buffer *
+get_current_buffer(struct client_state *state)
+{
+    if (state->preload) {
+        find_damage(state, NULL);
+        return state->preloaded.buffers[state->current_frame];
+    }
+
+    AVFrame *frame = get_current_frame(state);
+    /* Only the very first frame gets here before the store has it, the
+     * others are waited for in select_cached_frame() */
+    if (!frame && state->store_budget)
+        return NULL;
+    find_damage(state, frame);
+
+    /* Decoded straight into shared memory, nothing left to do */
+    struct decode_slot *slot = frame && state->streaming ?
+        decode_pool_find(&state->decode_pool, frame->data[0]) : NULL;
+    struct wl_buffer *buffer = slot ? decode_slot_attach(slot, state->wl_shm) :
+        draw_frame(state, frame,
+                state->frame_boxes ? &state->frame_boxes[state->current_frame] : NULL);
+
+    /* Without a table or the store the next frame is compared against this
+     * one */
+    if (buffer && !state->frame_damage && !state->store_budget) {
+        if (!state->shown_frame)
+            state->shown_frame = av_frame_alloc();
+        if (state->shown_frame) {
+            av_frame_unref(state->shown_frame);
+            av_frame_ref(state->shown_frame, frame);
+        }
+    }
     return buffer;
 }
 
+/* Damages what changed since the frame on screen: the tiles that differ
+ * if they are known, else the visible parts of both frames, else all of
+ * it. The damage is then kept for buffers that come back later. */
+static void
+damage_video(struct client_state *state)
+{
+    const FrameDamage *damage = &state->damage;
+    const AlphaBox *box = state->frame_boxes ?
+        &state->frame_boxes[state->current_frame] : NULL;
+    const AlphaBox *shown = &state->shown_box;
+
+    if (!damage->full) {
+        for (int i = 0; i < damage->count; i++) {
+            const DamageRect *rect = &damage->rects[i];
+            wl_surface_damage_buffer(state->video_surface, rect->x, rect->y,
+                    rect->width, rect->height);
+        }
+        state->stats.damaged += damage_area(state, damage);
+    } else if (box && state->shown_box_valid) {
+        /* Outside both boxes both frames are transparent */
+        if (shown->width > 0)
+            wl_surface_damage_buffer(state->video_surface, shown->x, shown->y,
+                    shown->width, shown->height);
+        if (box->width > 0)
+            wl_surface_damage_buffer(state->video_surface, box->x, box->y,
+                    box->width, box->height);
+        state->stats.damaged += (double)shown->width * shown->height +
+            (double)box->width * box->height;
+    } else {
+        wl_surface_damage_buffer(state->video_surface, 0, 0, INT32_MAX, INT32_MAX);
+        state->stats.damaged += (double)state->img_width * state->img_height;
+    }
+
+    state->frame_seq++;
+    state->damage_history[state->frame_seq % DAMAGE_HISTORY] = *damage;
+    state->shown_index = state->current_frame;
+}
+
+/* Keeps input and the opaque region to the visible part of the frame */
+static void
+update_visible_box(struct client_state *state)
+{
+    if (!state->frame_boxes)
+        return;
+
+    const AlphaBox *box = &state->frame_boxes[state->current_frame];
+    AlphaBox *shown = &state->shown_box;
+    if (state->shown_box_valid && box->x == shown->x && box->y == shown->y &&
+            box->width == shown->width && box->height == shown->height &&
+            box->opaque == shown->opaque) {
+        return;
+    }
+
+    struct wl_region *visible = wl_compositor_create_region(state->wl_compositor);
+    if (box->width > 0)
+        wl_region_add(visible, box->x, box->y, box->width, box->height);
+    wl_surface_set_input_region(state->video_surface, visible);
+    wl_surface_set_opaque_region(state->video_surface, box->opaque ? visible : NULL);
+    wl_region_destroy(visible);
+    *shown = *box;
+    state->shown_box_valid = true;
+}
+
+/* The canvas takes the size the compositor asked for, else the output's,
+ * else just enough for the video. Its content never changes, so it is only
+ * re-attached when that size does. */
+static void
+update_canvas(struct client_state *state)
+{
+    int width = state->configured_width;
+    int height = state->configured_height;
+    if (width <= 0 || height <= 0) {
+        width = state->output_width;
+        height = state->output_height;
+    }
+    if (width <= 0 || height <= 0) {
+        width = state->img_width;
+        height = state->img_height;
+    }
+
+    if (state->canvas_buffer && width == state->width && height == state->height)
+        return;
+
+    struct wl_buffer *buffer = create_blank_buffer(state->wl_shm, width, height);
+    if (!buffer)
+        return;
+    wl_surface_attach(state->wl_surface, buffer, 0, 0);
+    wl_surface_damage_buffer(state->wl_surface, 0, 0, INT32_MAX, INT32_MAX);
+    if (state->canvas_buffer)
+        wl_buffer_destroy(state->canvas_buffer);
+    state->canvas_buffer = buffer;
+    state->width = width;
+    state->height = height;
+}
+
+/* Moving the video only takes a new subsurface position, which is applied
+ * with the parent's next commit: no pixels are touched */
+static void
+move_video(struct client_state *state)
+{
+    wl_subsurface_set_position(state->video_subsurface, state->img_x, state->img_y);
+    wl_surface_commit(state->wl_surface);
+}
+
+static void start_playback(struct client_state *state);
+
 static void
 xdg_surface_configure(void *data,
         struct xdg_surface *xdg_surface, uint32_t serial)
@@ -168,15 +980,91 @@ xdg_surface_configure(void *data,
     struct client_state *state = data;
     xdg_surface_ack_configure(xdg_surface, serial);
 
-    struct wl_buffer *buffer = draw_frame(state, 0);
-    wl_surface_attach(state->wl_surface, buffer, 0, 0);
-    wl_surface_commit(state->wl_surface);
+    if (!state->video_mapped) {
+        start_playback(state);
+        state->video_mapped = true;
+    }
+
+    update_canvas(state);
+    move_video(state);
 }
 
 static const struct xdg_surface_listener xdg_surface_listener = {
     .configure = xdg_surface_configure,
 };
 
+static void
+xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel,
+        int32_t width, int32_t height, struct wl_array *states)
+{
+    struct client_state *state = data;
+    state->configured_width = width;
+    state->configured_height = height;
+}
+
+static void
+xdg_toplevel_close(void *data, struct xdg_toplevel *xdg_toplevel)
+{
+    struct client_state *state = data;
+    state->closed = true;
+}
+
+static const struct xdg_toplevel_listener xdg_toplevel_listener = {
+    .configure = xdg_toplevel_configure,
+    .close = xdg_toplevel_close,
+};
+
+static void
+wl_output_geometry(void *data, struct wl_output *wl_output, int32_t x, int32_t y,
+        int32_t physical_width, int32_t physical_height, int32_t subpixel,
+        const char *make, const char *model, int32_t transform)
+{
+    /* This space deliberately left blank */
+}
+
+static void
+wl_output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
+        int32_t width, int32_t height, int32_t refresh)
+{
+    struct client_state *state = data;
+    if (flags & WL_OUTPUT_MODE_CURRENT) {
+        state->output_width = width;
+        state->output_height = height;
+    }
+}
+
+static void
+wl_output_done(void *data, struct wl_output *wl_output)
+{
+    /* This space deliberately left blank */
+}
+
+static void
+wl_output_scale(void *data, struct wl_output *wl_output, int32_t factor)
+{
+    /* This space deliberately left blank */
+}
+
+static const struct wl_output_listener wl_output_listener = {
+    .geometry = wl_output_geometry,
+    .mode = wl_output_mode,
+    .done = wl_output_done,
+    .scale = wl_output_scale,
+};
+
+static void
+wl_shm_format(void *data, struct wl_shm *wl_shm, uint32_t format)
+{
+    struct client_state *state = data;
+    uint32_t *entry = wl_array_add(&state->shm_formats, sizeof(*entry));
+    if (entry)
+        *entry = format;
+}
+
+static const struct wl_shm_listener wl_shm_listener = {
+    .format = wl_shm_format,
+};
+
 static void
 xdg_wm_base_ping(void *data, struct xdg_wm_base *xdg_wm_base, uint32_t serial)
 {
@@ -230,8 +1118,6 @@ wl_keyboard_enter(void *data, struct wl_keyboard *wl_keyboard,
     }
 }
 
-void update_surface();
-
 static void
 wl_keyboard_key(void *data, struct wl_keyboard *wl_keyboard,
                 uint32_t serial, uint32_t time, uint32_t key, uint32_t state)
@@ -241,21 +1127,24 @@ wl_keyboard_key(void *data, struct wl_keyboard *wl_keyboard,
     uint32_t keycode = key + 8;
     xkb_keysym_t sym = xkb_state_key_get_one_sym(client_state->xkb_state, keycode);
     xkb_keysym_get_name(sym, buf, sizeof(buf));
-    const char *action = state == WL_KEYBOARD_KEY_STATE_PRESSED ? "press" : "release";
-    //fprintf(stderr, "key %s: sym: %-12s (%d), ", action, buf, sym);
+    bool pressed = state == WL_KEYBOARD_KEY_STATE_PRESSED;
+    //fprintf(stderr, "key %s: sym: %-12s (%d), ", pressed ? "press" : "release", buf, sym);
     xkb_state_key_get_utf8(client_state->xkb_state, keycode, buf, sizeof(buf));
     //fprintf(stderr, "utf8: '%s'\n", buf);
     printf("%d\n", key);
     
-    if(key == 30 && action == "press"){
+    if(key == 30 && pressed){
         client_state->img_x -= 10;
-        //update_surface();
-    } else if(key == 31 && action == "press"){
+        move_video(client_state);
+    } else if(key == 31 && pressed){
         client_state->img_y += 10;
-    } else if(key == 32 && action == "press"){
+        move_video(client_state);
+    } else if(key == 32 && pressed){
         client_state->img_x += 10;
-    } else if(key == 17 && action == "press"){
+        move_video(client_state);
+    } else if(key == 17 && pressed){
         client_state->img_y -= 10;
+        move_video(client_state);
     }
 }
 
@@ -331,6 +1220,8 @@ static const struct wl_seat_listener wl_seat_listener = {
     .name = wl_seat_name,
 };
 
+static void maybe_present(struct client_state *state);
+
 static void
 wl_surface_frame_done(void *data, struct wl_callback *cb, uint32_t time)
 {
@@ -338,43 +1229,237 @@ wl_surface_frame_done(void *data, struct wl_callback *cb, uint32_t time)
     wl_callback_destroy(cb);
 
     struct client_state *state = data;
+    state->frame_callback = NULL;
+    maybe_present(state);
+}
+
+static const struct wl_callback_listener wl_surface_frame_listener = {
+	.done = wl_surface_frame_done,
+};
 
-    /* Calculate time elapsed since the last frame */
+/* Attaches the current frame and commits it along with a new frame
+ * callback. If no buffer is free the current one stays up and the commit
+ * only carries the frame callback. */
+static void
+present_frame(struct client_state *state)
+{
+    clock_gettime(CLOCK_MONOTONIC, &state->last_frame_time);
+
+    state->frame_callback = wl_surface_frame(state->video_surface);
+    wl_callback_add_listener(state->frame_callback, &wl_surface_frame_listener, state);
+
+    struct wl_buffer *buffer = get_current_buffer(state);
+    if (buffer) {
+        wl_surface_attach(state->video_surface, buffer, 0, 0);
+        damage_video(state);
+        update_visible_box(state);
+        state->stats.frames_presented++;
+    } else {
+        state->stats.frames_repeated++;
+    }
+    wl_surface_commit(state->video_surface);
+
+    if (state->show_stats &&
+            timespec_diff(&state->last_frame_time, &state->stats.last_report) >= STATS_INTERVAL) {
+        print_stats(state);
+        state->stats.last_report = state->last_frame_time;
+    }
+}
+
+static double
+media_clock(struct client_state *state)
+{
     struct timespec now;
     clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_diff(&now, &state->clock_start);
+}
 
-    double elapsed_time = (now.tv_sec - state->last_frame_time.tv_sec) +
-                          (now.tv_nsec - state->last_frame_time.tv_nsec) / 1e9;
+static double
+frame_time(struct client_state *state, const AVFrame *frame)
+{
+    return frame->pts * av_q2d(state->time_base);
+}
 
-    /* Sleep if we're ahead of schedule */
-    if (elapsed_time < state->frame_duration) {
-        struct timespec ts = {0};
-        double sleep_time = state->frame_duration - elapsed_time;
-        ts.tv_sec = (time_t)sleep_time;
-        ts.tv_nsec = (long)((sleep_time - ts.tv_sec) * 1e9);
-        nanosleep(&ts, NULL);
+/* Picks the cached frame whose presentation time matches the clock, or
+ * just the next one unless the policy allows dropping. Returns false if
+ * that is still the current one. */
+static bool
+select_cached_frame(struct client_state *state, double clock)
+{
+    int count = get_frame_count(state);
+    long loop;
+    int lo;
+
+    if (state->drop_policy == DROP_CATCH_UP || state->current_loop < 0) {
+        loop = (long)floor(clock / state->clip_duration);
+        double t = clock - loop * state->clip_duration;
+
+        /* Last frame due at or before t */
+        lo = 0;
+        int hi = count - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (state->frame_times[mid] <= t)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+    } else {
+        loop = state->current_loop;
+        lo = state->current_frame + 1;
+        if (lo == count) {
+            lo = 0;
+            loop++;
+        }
     }
 
-    /* Update the timestamp for the last frame */
-    clock_gettime(CLOCK_MONOTONIC, &state->last_frame_time);
+    if (lo == state->current_frame && loop == state->current_loop)
+        return false;
 
-    /* Submit the next frame */
-    struct wl_buffer *buffer = draw_frame(state, state->current_frame);
-    wl_surface_attach(state->wl_surface, buffer, 0, 0);
-    wl_surface_damage_buffer(state->wl_surface, 0, 0, INT32_MAX, INT32_MAX);
-    wl_surface_commit(state->wl_surface);
+    /* Not decoded yet: the frame on screen stays up and this one is tried
+     * again at the next wake-up, the store heading for it meanwhile. The
+     * position doesn't move, so it is only ever skipped, and then counted
+     * as dropped, when catching up moves past it. */
+    if (state->store_budget && !frameStoreRequest(&state->frame_store, lo)) {
+        if (!state->store_waiting)
+            state->stats.frames_repeated++;
+        state->store_waiting = true;
+        return false;
+    }
+    state->store_waiting = false;
 
-    /* Advance to the next frame */
-    state->current_frame = (state->current_frame + 1) % state->frame_array.frame_count;
+    if (state->current_loop >= 0) {
+        long skipped = (loop - state->current_loop) * count + lo - state->current_frame - 1;
+        if (skipped > 0)
+            state->stats.frames_dropped += skipped;
+    }
 
-    /* Request another frame callback */
-    cb = wl_surface_frame(state->wl_surface);
-    wl_callback_add_listener(cb, &wl_surface_frame_listener, state);
+    state->current_frame = lo;
+    state->current_loop = loop;
+    state->current_time = loop * state->clip_duration + state->frame_times[lo];
+    if (lo + 1 < count)
+        state->next_time = loop * state->clip_duration + state->frame_times[lo + 1];
+    else
+        state->next_time = (loop + 1) * state->clip_duration + state->frame_times[0];
+    return true;
 }
 
-static const struct wl_callback_listener wl_surface_frame_listener = {
-	.done = wl_surface_frame_done,
-};
+/* Same for the decode ring, whose frame times keep counting up across
+ * loops. Frames can only be taken in order here. */
+static bool
+select_streamed_frame(struct client_state *state, double clock)
+{
+    FrameRing *ring = &state->frame_ring;
+    bool changed = false;
+    AVFrame *next;
+
+    while ((next = frameRingNext(ring)) && frame_time(state, next) <= clock) {
+        if (changed)
+            state->stats.frames_dropped++;
+        frameRingAdvance(ring);
+        changed = true;
+        if (state->drop_policy != DROP_CATCH_UP) {
+            next = frameRingNext(ring);
+            break;
+        }
+    }
+
+    AVFrame *front = frameRingFront(ring);
+    state->current_time = frame_time(state, front);
+    if (next) {
+        state->next_time = frame_time(state, next);
+        state->stalled = false;
+    } else {
+        state->next_time = state->current_time + front->duration * av_q2d(state->time_base);
+        /* Decoder underrun: the decode thread wakes us when it catches up */
+        if (clock >= state->next_time && !state->stalled) {
+            state->stats.underruns++;
+            state->stats.frames_repeated++;
+            state->stalled = true;
+        }
+    }
+    return changed;
+}
+
+static bool
+select_frame(struct client_state *state, double clock)
+{
+    if (state->streaming)
+        return select_streamed_frame(state, clock);
+    return select_cached_frame(state, clock);
+}
+
+static void
+schedule_next_frame(struct client_state *state)
+{
+    if (state->stalled)
+        return;
+
+    struct timespec deadline = state->clock_start;
+    timespec_add(&deadline, state->next_time);
+    /* The store has no way to wake us when the frame comes in */
+    if (state->store_waiting) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        timespec_add(&deadline, STORE_RETRY_INTERVAL);
+    }
+
+    struct itimerspec its = { .it_value = deadline };
+    timerfd_settime(state->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* Books how late the current frame went up. Frames more than half their
+ * own duration late count as late; in slow motion they also push the
+ * clock back so the frames after them keep their spacing. */
+static void
+account_frame(struct client_state *state, double clock)
+{
+    double drift = clock - state->current_time;
+    state->stats.drift_last = drift;
+    state->stats.drift_total += drift;
+    if (drift > state->stats.drift_max)
+        state->stats.drift_max = drift;
+
+    double duration = state->next_time - state->current_time;
+    if (drift > duration / 2) {
+        state->stats.frames_late++;
+        if (state->drop_policy == DROP_SLOW_MOTION) {
+            timespec_add(&state->clock_start, drift);
+        }
+    }
+}
+
+/* Starts the media clock with the first frame going up now */
+static void
+start_playback(struct client_state *state)
+{
+    clock_gettime(CLOCK_MONOTONIC, &state->clock_start);
+    state->current_loop = -1;
+    select_frame(state, 0);
+    timespec_add(&state->clock_start, -state->current_time);
+
+    present_frame(state);
+    schedule_next_frame(state);
+}
+
+/* Shows the frame matching the media clock once the next frame is due
+ * and the compositor has asked for a new one; called whenever either
+ * changes or a decoded frame comes in. Never blocks. */
+static void
+maybe_present(struct client_state *state)
+{
+    if (!state->video_mapped || state->frame_callback)
+        return;
+
+    double clock = media_clock(state);
+    if (clock < state->next_time)
+        return;
+
+    if (select_frame(state, clock)) {
+        present_frame(state);
+        account_frame(state, clock);
+    }
+    schedule_next_frame(state);
+}
 
 static void
 registry_global(void *data, struct wl_registry *wl_registry,
@@ -384,11 +1469,16 @@ registry_global(void *data, struct wl_registry *wl_registry,
     if (strcmp(interface, wl_shm_interface.name) == 0) 
     {
         state->wl_shm = wl_registry_bind(wl_registry, name, &wl_shm_interface, 1);
+        wl_shm_add_listener(state->wl_shm, &wl_shm_listener, state);
     } 
     else if (strcmp(interface, wl_compositor_interface.name) == 0) 
     {
         state->wl_compositor = wl_registry_bind(wl_registry, name, &wl_compositor_interface, 4);
     } 
+    else if (strcmp(interface, wl_subcompositor_interface.name) == 0)
+    {
+        state->wl_subcompositor = wl_registry_bind(wl_registry, name, &wl_subcompositor_interface, 1);
+    }
     else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
         state->xdg_wm_base = wl_registry_bind(wl_registry, name, &xdg_wm_base_interface, 1);
         xdg_wm_base_add_listener(state->xdg_wm_base, &xdg_wm_base_listener, state);
@@ -397,6 +1487,10 @@ registry_global(void *data, struct wl_registry *wl_registry,
         state->wl_seat = wl_registry_bind(wl_registry, name, &wl_seat_interface, 7);
         wl_seat_add_listener(state->wl_seat, &wl_seat_listener, state);
     }
+    else if (strcmp(interface, wl_output_interface.name) == 0 && state->wl_output == NULL) {
+        state->wl_output = wl_registry_bind(wl_registry, name, &wl_output_interface, 2);
+        wl_output_add_listener(state->wl_output, &wl_output_listener, state);
+    }
 }
 
 static void
@@ -411,68 +1505,433 @@ static const struct wl_registry_listener wl_registry_listener = {
     .global_remove = registry_global_remove,
 };
 
-void update_surface()
+static void
+usage(const char *argv0)
 {
-    struct client_state state = { 0 };
-    struct wl_callback *cb = wl_surface_frame(state.wl_surface);
-	wl_callback_add_listener(cb, &wl_surface_frame_listener, &state);
+    fprintf(stderr, "usage: %s [options] <video> <x> <y>\n"
+            "       %s --bench [video]\n"
+            "  -s, --stream          decode while playing instead of up front\n"
+            "  -r, --ring-size N     frames kept decoded ahead when streaming (default 8)\n"
+            "  -k, --packets         read the compressed video into memory once and decode\n"
+            "                        it from there as it plays (implies --stream)\n"
+            "  -d, --drop-policy P   drop (default), never or slowmo when frames run late\n"
+            "  -p, --preload         convert every frame into shared memory up front\n"
+            "  -C, --cache DIR       keep the preloaded frames in DIR and map them\n"
+            "                        straight from there on later runs (implies --preload)\n"
+            "      --frame-format F  keep frames decoded up front as native (default), converted\n"
+            "                        at every display, or as argb, converted once at load\n"
+            "      --budget MB       keep at most MB of decoded frames, decoding the rest\n"
+            "                        again from their keyframe when they come round\n"
+            "      --ahead N         frames kept decoded ahead within the budget (default 32)\n"
+            "  -c, --convert K       conversion kernel: swscale, scalar, sse4.1, avx2 or avx512\n"
+            "                        (default: fastest the CPU supports)\n"
+            "      --convert-threads N\n"
+            "                        threads converting each frame in bands (default: one per CPU)\n"
+            "  -t, --decode-threads T\n"
+            "                        decoder threading: auto (default), frame, slice,\n"
+            "                        a thread count, or frame:N / slice:N\n"
+            "      --gop-workers N   decoders splitting the up-front decode at keyframes\n"
+            "                        (default: one per CPU, 1 decodes serially)\n"
+            "      --stats           print playback statistics every few seconds\n"
+            "      --bench           time decoding and check and time the conversion\n"
+            "                        kernels, then exit\n",
+            argv0, argv0);
 }
 
 int
 main(int argc, char *argv[])
 {
     struct client_state state = { 0 };
+    state.ring_size = 8;
+    state.store_ahead = 32;
+
+    static const struct option long_options[] = {
+        { "stream",      no_argument,       NULL, 's' },
+        { "ring-size",   required_argument, NULL, 'r' },
+        { "packets",     no_argument,       NULL, 'k' },
+        { "drop-policy", required_argument, NULL, 'd' },
+        { "preload",     no_argument,       NULL, 'p' },
+        { "cache",       required_argument, NULL, 'C' },
+        { "frame-format", required_argument, NULL, 'F' },
+        { "budget",      required_argument, NULL, 'M' },
+        { "ahead",       required_argument, NULL, 'A' },
+        { "convert",     required_argument, NULL, 'c' },
+        { "convert-threads", required_argument, NULL, 'T' },
+        { "decode-threads", required_argument, NULL, 't' },
+        { "gop-workers", required_argument, NULL, 'G' },
+        { "stats",       no_argument,       NULL, 'S' },
+        { "bench",       no_argument,       NULL, 'B' },
+        { NULL, 0, NULL, 0 },
+    };
+    bool bench = false;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "sr:kd:pC:c:t:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's':
+            state.streaming = true;
+            break;
+        case 'r':
+            state.ring_size = atoi(optarg);
+            break;
+        case 'k':
+            state.cache_packets = true;
+            state.streaming = true;
+            break;
+        case 'd':
+            if (strcmp(optarg, "drop") == 0) {
+                state.drop_policy = DROP_CATCH_UP;
+            } else if (strcmp(optarg, "never") == 0) {
+                state.drop_policy = DROP_NEVER;
+            } else if (strcmp(optarg, "slowmo") == 0) {
+                state.drop_policy = DROP_SLOW_MOTION;
+            } else {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            state.preload = true;
+            break;
+        case 'C':
+            state.cache_dir = optarg;
+            state.preload = true;
+            break;
+        case 'F':
+            if (strcmp(optarg, "argb") == 0) {
+                state.keep_argb = true;
+            } else if (strcmp(optarg, "native") != 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'M':
+            state.store_budget = (size_t)atol(optarg) << 20;
+            if (state.store_budget == 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'A':
+            state.store_ahead = atoi(optarg);
+            if (state.store_ahead < 2) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'c':
+            if (selectConverterPath(&state.converter, optarg) < 0) {
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'T':
+            state.converter.threads = atoi(optarg);
+            if (state.converter.threads < 1 || state.converter.threads > CONVERT_MAX_THREADS) {
+                fprintf(stderr, "--convert-threads must be between 1 and %d\n", CONVERT_MAX_THREADS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            if (parseDecoderThreading(optarg, &state.decoder_threading) < 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'G':
+            state.decoder_threading.gop_workers = atoi(optarg);
+            if (state.decoder_threading.gop_workers < 1) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'S':
+            state.show_stats = true;
+            break;
+        case 'B':
+            bench = true;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (bench) {
+        return runBenchmark(optind < argc ? argv[optind] : NULL) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (argc - optind < 3 || state.ring_size < 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (state.streaming && state.preload) {
+        fprintf(stderr, "--stream and --preload are mutually exclusive\n");
+        return EXIT_FAILURE;
+    }
+    if (state.store_budget && (state.streaming || state.preload)) {
+        fprintf(stderr, "--budget can't be combined with --stream or --preload\n");
+        return EXIT_FAILURE;
+    }
+    if (state.keep_argb && (state.streaming || state.preload || state.store_budget)) {
+        fprintf(stderr, "--frame-format only applies to frames decoded up front\n");
+        return EXIT_FAILURE;
+    }
+    argv += optind - 1;
 
     state.img_path = argv[1];
 
-    state.height = 2160;
-    state.width = 3840;
+    AVRational frame_rate;
+    AVFrame *first_frame = NULL;
+    if (state.cache_dir &&
+            disk_cache_open(&state.disk_cache, state.cache_dir, state.img_path) == 0) {
+        /* Everything needed to play comes from the cache header */
+        const struct disk_cache_header *header = &state.disk_cache.header;
+        state.cache_hit = true;
+        frame_rate = (AVRational){ header->frame_rate_num, header->frame_rate_den };
+        state.time_base = (AVRational){ header->time_base_num, header->time_base_den };
+        state.frame_times = calloc(header->frame_count, sizeof(double));
+        for (uint32_t i = 0; i < header->frame_count; i++)
+            state.frame_times[i] = state.disk_cache.frames[i].pts * av_q2d(state.time_base);
+        state.clip_duration = header->duration * av_q2d(state.time_base);
+        if (state.clip_duration <= 0)
+            state.clip_duration = header->frame_count / av_q2d(frame_rate);
+        state.img_width = header->width;
+        state.img_height = header->height;
+        state.opaque = header->format == WL_SHM_FORMAT_XRGB8888;
+        if (!state.opaque)
+            state.frame_boxes = calloc(header->frame_count, sizeof(AlphaBox));
+        for (uint32_t i = 0; state.frame_boxes && i < header->frame_count; i++) {
+            const struct disk_cache_frame *frame = &state.disk_cache.frames[i];
+            state.frame_boxes[i] = (AlphaBox){ frame->box_x, frame->box_y,
+                frame->box_width, frame->box_height, frame->box_opaque };
+        }
+        state.frame_damage = calloc(header->frame_count, sizeof(FrameDamage));
+        for (uint32_t i = 0; state.frame_damage && i < header->frame_count; i++)
+            load_frame_damage(&state.disk_cache.frames[i], &state.frame_damage[i]);
+    } else if (state.streaming) {
+        /* Enough slots for the ring, the frames the codec keeps as
+         * references and those the compositor still holds */
+        decode_pool_init(&state.decode_pool, state.ring_size + 8);
+        DecoderBuffers buffers = {
+            .get_buffer2 = get_decode_buffer,
+            .finish_frame = copy_out_frame,
+            .opaque = &state,
+        };
+        state.copy_converter.premultiply = true;
+        if (initFrameRing(&state.frame_ring, state.img_path, state.ring_size,
+                          &state.decoder_threading, state.cache_packets, &buffers) < 0) {
+            fprintf(stderr, "Failed to open the video for streaming.\n");
+            return EXIT_FAILURE;
+        }
+        if (state.decode_pool.data && state.decode_pool.format == WL_SHM_FORMAT_ARGB8888)
+            printf("Premultiplying decoded frames into shared memory\n");
+        else if (state.decode_pool.data)
+            printf("Decoding straight into shared memory\n");
+        if (state.cache_packets) {
+            printf("Holding %d packets in %.1f MiB\n", state.frame_ring.decoder->packet_count,
+                   state.frame_ring.decoder->packet_bytes / 1048576.0);
+        }
+        frame_rate = state.frame_ring.decoder->frame_rate;
+        state.time_base = state.frame_ring.decoder->time_base;
+        first_frame = frameRingFront(&state.frame_ring);
+    } else if (state.store_budget) {
+        if (initFrameStore(&state.frame_store, state.img_path, state.store_budget,
+                           state.store_ahead, &state.decoder_threading) < 0) {
+            fprintf(stderr, "Failed to open the video.\n");
+            return EXIT_FAILURE;
+        }
+        FrameStore *store = &state.frame_store;
+        printf("Number of frames: %d, %d kept decoded ahead in %zu MiB\n",
+               store->frame_count, store->window, state.store_budget >> 20);
+        frame_rate = store->index.frame_rate;
+        state.time_base = store->index.time_base;
+        first_frame = store->frames[0];
 
-    if(atoi(argv[2]) == -1 || atoi(argv[3]) == -1)
-    {
-        state.img_x = (state.width / 2) - (state.img_width / 2);
-        state.img_y = (state.height / 2) - (state.img_height / 2);
-        printf("%s\n", state.img_x);
-        printf("%s\n", state.img_y);
-    }else{
-        state.img_x = atoi(argv[2]);
-        state.img_y = atoi(argv[3]);
-    }
+        state.frame_times = calloc(store->frame_count, sizeof(double));
+        for (int i = 0; i < store->frame_count; i++)
+            state.frame_times[i] = frameStoreTime(store, i);
+        state.clip_duration = store->index.duration * av_q2d(state.time_base);
+        if (state.clip_duration <= 0)
+            state.clip_duration = store->frame_count / av_q2d(frame_rate);
+    } else {
+        state.frame_array = getFrames(state.img_path, &state.decoder_threading);
 
-    state.frame_array = getFrames(argv[1]);
+        if (state.frame_array.frames == NULL || state.frame_array.frame_count == 0) {
+            fprintf(stderr, "Failed to retrieve frames from the video.\n");
+            return EXIT_FAILURE;
+        }
+        printf("Number of frames: %d\n", state.frame_array.frame_count);
+        const DecodeStats *decode = &state.frame_array.decode_stats;
+        printf("Decoded in %.2f s at %.1f fps (%s, %d decoder(s), %s threading with %d thread(s) each)\n",
+               atomic_load(&decode->decode_ns) / 1e9, decodeFps(decode), decode->codec,
+               decode->decoders, threadTypeName(decode->thread_type), decode->thread_count);
+        if (state.frame_array.arena_size) {
+            printf("Frames packed into a %zu MiB arena on %s pages\n",
+                   state.frame_array.arena_size >> 20, state.frame_array.arena_backing);
+        }
+        frame_rate = state.frame_array.frame_rate;
+        state.time_base = state.frame_array.time_base;
+        first_frame = state.frame_array.frames[0];
 
-    if (state.frame_array.frames == NULL) {
-        fprintf(stderr, "Failed to retrieve frames from the video.\n");
-        return EXIT_FAILURE;
+        /* Keep the frame times around, the frames themselves may go */
+        state.frame_times = calloc(state.frame_array.frame_count, sizeof(double));
+        for (int i = 0; i < state.frame_array.frame_count; i++)
+            state.frame_times[i] = frame_time(&state, state.frame_array.frames[i]);
+        state.clip_duration = state.frame_array.duration * av_q2d(state.time_base);
+        if (state.clip_duration <= 0)
+            state.clip_duration = state.frame_array.frame_count / av_q2d(frame_rate);
+    }
+    printf("Frame rate: %d/%d\n", frame_rate.num, frame_rate.den);
+    if (first_frame) {
+        state.img_width = first_frame->width;
+        state.img_height = first_frame->height;
+        const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(first_frame->format);
+        state.opaque = desc && !(desc->flags & AV_PIX_FMT_FLAG_ALPHA);
     }
-    printf("Number of frames: %d\n", state.frame_array.frame_count);
+    /* Without alpha the compositor needn't blend the video nor draw what
+     * is behind it */
+    state.rgb_format = state.opaque ? WL_SHM_FORMAT_XRGB8888 : WL_SHM_FORMAT_ARGB8888;
+    if (state.opaque) {
+        printf("No alpha channel, showing opaque XRGB8888 frames\n");
+    } else if (!state.cache_hit) {
+        state.converter.premultiply = true;
+        printf("Premultiplying alpha for ARGB8888 (%s)\n", bestPremultiplyKernel()->name);
+    }
+    if (!state.opaque && state.frame_array.frames)
+        find_frame_boxes(&state);
 
-    state.frame_duration = 1.0 / state.frame_array.frame_rate;
-    state.current_frame = 0;
     clock_gettime(CLOCK_MONOTONIC, &state.last_frame_time);
+    state.stats.last_report = state.last_frame_time;
 
+    wl_array_init(&state.shm_formats);
     state.wl_display = wl_display_connect(NULL);
     state.wl_registry = wl_display_get_registry(state.wl_display);
     state.xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
     wl_registry_add_listener(state.wl_registry, &wl_registry_listener, &state);
     wl_display_roundtrip(state.wl_display);
+    /* Second roundtrip for the events of the globals we just bound */
+    wl_display_roundtrip(state.wl_display);
+    /* The formats don't change from here on, the decode thread may look */
+    atomic_store_explicit(&state.shm_formats_ready, true, memory_order_release);
+    bool yuv420 = shm_format_supported(&state, WL_SHM_FORMAT_YUV420);
+    bool nv12 = shm_format_supported(&state, WL_SHM_FORMAT_NV12);
+    if (yuv420 || nv12) {
+        printf("Compositor takes%s%s in shared memory, matching frames go unconverted\n",
+               yuv420 ? " YUV420" : "", nv12 ? " NV12" : "");
+    }
+
+    /* The position is relative to the output; -1 centres the video on it */
+    if(atoi(argv[2]) == -1 || atoi(argv[3]) == -1)
+    {
+        state.img_x = (state.output_width / 2) - (state.img_width / 2);
+        state.img_y = (state.output_height / 2) - (state.img_height / 2);
+        printf("%d\n", state.img_x);
+        printf("%d\n", state.img_y);
+    }else{
+        state.img_x = atoi(argv[2]);
+        state.img_y = atoi(argv[3]);
+    }
+
+    if (state.preload && preload_frames(&state) < 0) {
+        fprintf(stderr, "Failed to preload the frames.\n");
+        return EXIT_FAILURE;
+    }
+    if (state.frame_array.frames && !state.preload) {
+        if (prepare_frame_array(&state) < 0) {
+            fprintf(stderr, "Failed to convert the frames.\n");
+            return EXIT_FAILURE;
+        }
+        find_frame_damage(&state);
+    }
 
     state.wl_surface = wl_compositor_create_surface(state.wl_compositor);
+    state.video_surface = wl_compositor_create_surface(state.wl_compositor);
+    state.video_subsurface = wl_subcompositor_get_subsurface(
+            state.wl_subcompositor, state.video_surface, state.wl_surface);
+    /* Let video frames go up without waiting for a parent commit */
+    wl_subsurface_set_desync(state.video_subsurface);
+
+    if (state.opaque) {
+        struct wl_region *video = wl_compositor_create_region(state.wl_compositor);
+        wl_region_add(video, 0, 0, state.img_width, state.img_height);
+        wl_surface_set_opaque_region(state.video_surface, video);
+        wl_region_destroy(video);
+    }
+
+    /* The canvas is see-through, so it shouldn't catch input either */
+    struct wl_region *empty = wl_compositor_create_region(state.wl_compositor);
+    wl_surface_set_input_region(state.wl_surface, empty);
+    wl_region_destroy(empty);
+
     state.xdg_surface = xdg_wm_base_get_xdg_surface(
             state.xdg_wm_base, state.wl_surface);
     xdg_surface_add_listener(state.xdg_surface, &xdg_surface_listener, &state);
     state.xdg_toplevel = xdg_surface_get_toplevel(state.xdg_surface);
+    xdg_toplevel_add_listener(state.xdg_toplevel, &xdg_toplevel_listener, &state);
     xdg_toplevel_set_title(state.xdg_toplevel, "Choo Choo");
     wl_surface_commit(state.wl_surface);
 
-    struct wl_callback *cb = wl_surface_frame(state.wl_surface);
-	wl_callback_add_listener(cb, &wl_surface_frame_listener, &state);
-      
-    while (wl_display_dispatch(state.wl_display)) {
-        /* This space deliberately left blank */
+    state.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (state.timer_fd < 0) {
+        perror("timerfd_create");
+        return EXIT_FAILURE;
+    }
+
+    /* One loop multiplexes Wayland events, frame deadlines and decoded
+     * frames, so input is handled as soon as it arrives whatever the frame
+     * rate */
+    enum { POLL_DISPLAY, POLL_TIMER, POLL_DECODER };
+    struct pollfd fds[] = {
+        [POLL_DISPLAY] = { .fd = wl_display_get_fd(state.wl_display), .events = POLLIN },
+        [POLL_TIMER] = { .fd = state.timer_fd, .events = POLLIN },
+        [POLL_DECODER] = { .fd = state.streaming ? state.frame_ring.notify_fd : -1, .events = POLLIN },
+    };
+
+    while (!state.closed) {
+        while (wl_display_prepare_read(state.wl_display) != 0)
+            wl_display_dispatch_pending(state.wl_display);
+
+        fds[POLL_DISPLAY].events = POLLIN;
+        if (wl_display_flush(state.wl_display) < 0 && errno == EAGAIN)
+            fds[POLL_DISPLAY].events |= POLLOUT;
+
+        if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0) {
+            wl_display_cancel_read(state.wl_display);
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (fds[POLL_DISPLAY].revents & POLLIN) {
+            if (wl_display_read_events(state.wl_display) < 0)
+                break;
+        } else {
+            wl_display_cancel_read(state.wl_display);
+        }
+        if (wl_display_dispatch_pending(state.wl_display) < 0)
+            break;
+
+        uint64_t expirations;
+        if (fds[POLL_TIMER].revents & POLLIN)
+            read(state.timer_fd, &expirations, sizeof(expirations));
+        if (fds[POLL_DECODER].revents & POLLIN)
+            read(fds[POLL_DECODER].fd, &expirations, sizeof(expirations));
+
+        maybe_present(&state);
     }
 
+    if (state.streaming && !state.cache_hit) {
+        /* Frames decoded into the pool hold its slots: stop the decoder
+         * and let go of every frame before the pool goes */
+        freeFrameRing(&state.frame_ring);
+        av_frame_free(&state.shown_frame);
+        decode_pool_finish(&state.decode_pool);
+    }
     return 0;
 }
-//gcc -o client client.c xdg-shell-protocol.c ffmpeg.c -lwayland-client -lm -lavcodec -lavformat -lavutil -lswscale -lxkbcommon
-//./client ./sc3h2.mov 500 0
\ No newline at end of file
+//gcc -pthread -o client client.c xdg-shell-protocol.c ffmpeg.c framearena.c convert.c yuv2rgb.c workers.c bench.c shm.c diskcache.c framestore.c alpha.c damage.c -lwayland-client -lm -lavcodec -lavformat -lavutil -lswscale -lxkbcommon
+//./client ./sc3h2.mov 500 0
+//./client --stream ./sc3h2.mov 500 0
+//./client --packets ./sc3h2.mov 500 0
+//./client --preload ./sc3h2.mov 500 0
+//./client --cache ~/.cache/client ./sc3h2.mov 500 0
+//./client --budget 512 ./sc3h2.mov 500 0
+//./client --bench ./sc3h2.mov
\ No newline at end of file
@@ -0,0 +1,311 @@
+#include "convert.h"
+#include <libavutil/cpu.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Bands shorter than this cost more in synchronisation than they save
+#define MIN_BAND_ROWS 32
+// Band boundaries fall on multiples of this so that no chroma row is split
+#define BAND_ALIGN 4
+
+typedef struct {
+    Converter *conv;
+    const AVFrame *frame;
+    uint8_t *const *dst;
+    const int *dst_linesize;
+    bool nv12;
+    bool premultiply;
+    YuvCoeffs coeffs;
+    const AVPixFmtDescriptor *src_desc;
+    const AVPixFmtDescriptor *dst_desc;
+} ConvertJob;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bandRows(int height, int bands, int band, int *start, int *end) {
+    *start = (int)((int64_t)height * band / bands) & ~(BAND_ALIGN - 1);
+    *end = band == bands - 1 ? height : (int)((int64_t)height * (band + 1) / bands) & ~(BAND_ALIGN - 1);
+}
+
+// Starts or resizes the worker pool and returns how many bands a frame of
+// this height is split into
+static int prepareBands(Converter *conv, int height) {
+    int threads = conv->threads > 0 ? conv->threads : av_cpu_count();
+    threads = FFMAX(1, FFMIN(threads, CONVERT_MAX_THREADS));
+
+    if (conv->pool_threads != threads) {
+        if (conv->pool_threads > 0) {
+            freeWorkerPool(&conv->pool);
+        }
+        if (initWorkerPool(&conv->pool, threads) < 0) {
+            threads = 1;
+            initWorkerPool(&conv->pool, threads);
+        }
+        conv->pool_threads = threads;
+    }
+
+    return FFMAX(1, FFMIN(threads, height / MIN_BAND_ROWS));
+}
+
+static bool canBand(const AVPixFmtDescriptor *desc) {
+    return desc && !(desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)) &&
+           (1 << desc->log2_chroma_h) <= BAND_ALIGN;
+}
+
+static void freeScalers(Converter *conv) {
+    for (int i = 0; i < conv->sws_bands; i++) {
+        sws_freeContext(conv->sws_ctx[i]);
+        conv->sws_ctx[i] = NULL;
+    }
+    conv->sws_bands = 0;
+}
+
+static int prepareConverter(Converter *conv, const AVFrame *frame,
+                            int dst_width, int dst_height, enum AVPixelFormat dst_format, int bands) {
+    if (conv->sws_bands == bands &&
+            conv->src_width == frame->width && conv->src_height == frame->height &&
+            conv->src_format == frame->format &&
+            conv->dst_width == dst_width && conv->dst_height == dst_height &&
+            conv->dst_format == dst_format) {
+        return 0;
+    }
+
+    double start = now_seconds();
+    freeScalers(conv);
+    for (int band = 0; band < bands; band++) {
+        // Each band is converted as if it were a whole frame of its own;
+        // with more than one band the conversion is unscaled
+        int row_start, row_end;
+        bandRows(frame->height, bands, band, &row_start, &row_end);
+        int src_height = bands > 1 ? row_end - row_start : frame->height;
+        int band_dst_height = bands > 1 ? row_end - row_start : dst_height;
+
+        conv->sws_ctx[band] = sws_getContext(frame->width, src_height, frame->format, dst_width, band_dst_height, dst_format, SWS_BICUBLIN, NULL, NULL, NULL);
+        if (!conv->sws_ctx[band]) {
+            fprintf(stderr, "Could not create conversion context\n");
+            conv->sws_bands = band;
+            freeScalers(conv);
+            return -1;
+        }
+        conv->sws_bands = band + 1;
+    }
+    conv->src_width = frame->width;
+    conv->src_height = frame->height;
+    conv->src_format = frame->format;
+    conv->dst_width = dst_width;
+    conv->dst_height = dst_height;
+    conv->dst_format = dst_format;
+
+    conv->init_count++;
+    conv->init_time += now_seconds() - start;
+    return 0;
+}
+
+static bool useKernel(const Converter *conv, const AVFrame *frame,
+                      int dst_width, int dst_height, enum AVPixelFormat dst_format, bool *nv12) {
+    if (conv->swscale_only || dst_format != AV_PIX_FMT_BGRA ||
+            dst_width != frame->width || dst_height != frame->height) {
+        return false;
+    }
+
+    switch (frame->format) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        *nv12 = false;
+        return true;
+    case AV_PIX_FMT_NV12:
+        *nv12 = true;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void kernelBand(void *arg, int band) {
+    const ConvertJob *job = arg;
+    const AVFrame *frame = job->frame;
+    int start, end;
+    bandRows(frame->height, job->conv->bands, band, &start, &end);
+
+    convertYuvRows(job->conv->kernel, job->nv12, (const uint8_t *const *)frame->data, frame->linesize,
+                   job->dst[0], job->dst_linesize[0], frame->width, start, end, &job->coeffs);
+}
+
+// Points planes at the first row of a band
+static void offsetPlanes(const AVPixFmtDescriptor *desc, uint8_t *const data[4], const int linesize[4],
+                         int row, uint8_t *planes[4]) {
+    for (int i = 0; i < 4; i++) {
+        int shift = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+        planes[i] = data[i] ? data[i] + (ptrdiff_t)(row >> shift) * linesize[i] : NULL;
+    }
+}
+
+static void swscaleBand(void *arg, int band) {
+    const ConvertJob *job = arg;
+    const AVFrame *frame = job->frame;
+    Converter *conv = job->conv;
+
+    if (conv->bands == 1) {
+        sws_scale(conv->sws_ctx[0], (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height, job->dst, job->dst_linesize);
+        if (job->premultiply) {
+            premultiplyRows(conv->premultiply_kernel, job->dst[0], job->dst_linesize[0],
+                            conv->dst_width, 0, conv->dst_height);
+        }
+        return;
+    }
+
+    int start, end;
+    uint8_t *src[4], *dst[4];
+    bandRows(frame->height, conv->bands, band, &start, &end);
+    offsetPlanes(job->src_desc, frame->data, frame->linesize, start, src);
+    offsetPlanes(job->dst_desc, job->dst, job->dst_linesize, start, dst);
+    sws_scale(conv->sws_ctx[band], (const uint8_t * const *)src, frame->linesize, 0, end - start, dst, job->dst_linesize);
+    if (job->premultiply) {
+        premultiplyRows(conv->premultiply_kernel, job->dst[0], job->dst_linesize[0], frame->width, start, end);
+    }
+}
+
+// Source and destination are the same format and size: nothing to convert,
+// just the rows of every plane to copy
+static void copyBand(void *arg, int band) {
+    const ConvertJob *job = arg;
+    const AVFrame *frame = job->frame;
+    int start, end;
+    uint8_t *src[4], *dst[4];
+    bandRows(frame->height, job->conv->bands, band, &start, &end);
+    offsetPlanes(job->src_desc, frame->data, frame->linesize, start, src);
+    offsetPlanes(job->dst_desc, job->dst, job->dst_linesize, start, dst);
+
+    for (int i = 0; i < 4 && src[i] && dst[i]; i++) {
+        int shift = (i == 1 || i == 2) ? job->src_desc->log2_chroma_h : 0;
+        int rows = AV_CEIL_RSHIFT(end, shift) - (start >> shift);
+        av_image_copy_plane(dst[i], job->dst_linesize[i], src[i], frame->linesize[i],
+                            av_image_get_linesize(frame->format, frame->width, i), rows);
+    }
+    if (job->premultiply) {
+        premultiplyRows(job->conv->premultiply_kernel, job->dst[0], job->dst_linesize[0], frame->width, start, end);
+    }
+}
+
+// Converts frame into dst, which is typically the mapped wl_buffer memory
+int convertFrame(Converter *conv, const AVFrame *frame,
+                 uint8_t *const dst[4], const int dst_linesize[4],
+                 int dst_width, int dst_height, enum AVPixelFormat dst_format) {
+    ConvertJob job = {
+        .conv = conv,
+        .frame = frame,
+        .dst = dst,
+        .dst_linesize = dst_linesize,
+    };
+    int bands = prepareBands(conv, frame->height);
+
+    if (useKernel(conv, frame, dst_width, dst_height, dst_format, &job.nv12)) {
+        // Untagged content is treated as limited range BT.601, like swscale does
+        YuvMatrix matrix = frame->colorspace == AVCOL_SPC_BT709 ? YUV_MATRIX_BT709 : YUV_MATRIX_BT601;
+        bool full_range = frame->color_range == AVCOL_RANGE_JPEG || frame->format == AV_PIX_FMT_YUVJ420P;
+        initYuvCoeffs(&job.coeffs, matrix, full_range);
+        if (!conv->kernel) {
+            conv->kernel = bestYuvKernel();
+        }
+
+        double start = now_seconds();
+        conv->bands = bands;
+        runWorkerPool(&conv->pool, kernelBand, &job, bands);
+        conv->path = conv->kernel->name;
+        conv->frame_count++;
+        conv->convert_time += now_seconds() - start;
+        return 0;
+    }
+
+    job.src_desc = av_pix_fmt_desc_get(frame->format);
+    job.dst_desc = av_pix_fmt_desc_get(dst_format);
+    // The 4:2:0 kernels above have no alpha to premultiply
+    job.premultiply = conv->premultiply && dst_format == AV_PIX_FMT_BGRA &&
+                      job.src_desc && (job.src_desc->flags & AV_PIX_FMT_FLAG_ALPHA);
+    if (job.premultiply && !conv->premultiply_kernel) {
+        conv->premultiply_kernel = bestPremultiplyKernel();
+    }
+    if (dst_format == frame->format && dst_width == frame->width && dst_height == frame->height &&
+            canBand(job.src_desc)) {
+        double start = now_seconds();
+        conv->bands = bands;
+        runWorkerPool(&conv->pool, copyBand, &job, bands);
+        conv->path = "copy";
+        conv->frame_count++;
+        conv->convert_time += now_seconds() - start;
+        return 0;
+    }
+    if (dst_width != frame->width || dst_height != frame->height ||
+            !canBand(job.src_desc) || !canBand(job.dst_desc)) {
+        bands = 1;
+    }
+    if (prepareConverter(conv, frame, dst_width, dst_height, dst_format, bands) < 0) {
+        return -1;
+    }
+
+    double start = now_seconds();
+    conv->bands = bands;
+    runWorkerPool(&conv->pool, swscaleBand, &job, bands);
+    conv->path = "swscale";
+    conv->frame_count++;
+    conv->convert_time += now_seconds() - start;
+    return 0;
+}
+
+// Converts frame into a newly allocated frame of the same size in format,
+// carrying over its timing and other properties
+AVFrame *convertToFrame(Converter *conv, const AVFrame *frame, enum AVPixelFormat format) {
+    AVFrame *converted = av_frame_alloc();
+    if (!converted) {
+        return NULL;
+    }
+    converted->format = format;
+    converted->width = frame->width;
+    converted->height = frame->height;
+    if (av_frame_get_buffer(converted, 0) < 0 || av_frame_copy_props(converted, frame) < 0 ||
+            convertFrame(conv, frame, converted->data, converted->linesize,
+                         frame->width, frame->height, format) < 0) {
+        av_frame_free(&converted);
+        return NULL;
+    }
+    return converted;
+}
+
+void freeConverter(Converter *conv) {
+    freeScalers(conv);
+    if (conv->pool_threads > 0) {
+        freeWorkerPool(&conv->pool);
+        conv->pool_threads = 0;
+    }
+}
+
+int selectConverterPath(Converter *conv, const char *name) {
+    if (strcmp(name, "swscale") == 0) {
+        conv->swscale_only = true;
+        return 0;
+    }
+
+    int count;
+    const YuvKernel *const *kernels = supportedYuvKernels(&count);
+    for (int i = 0; i < count; i++) {
+        if (strcmp(name, kernels[i]->name) == 0) {
+            conv->kernel = kernels[i];
+            conv->swscale_only = false;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "Conversion path %s is not supported here, choose one of: swscale", name);
+    for (int i = 0; i < count; i++) {
+        fprintf(stderr, " %s", kernels[i]->name);
+    }
+    fprintf(stderr, "\n");
+    return -1;
+}
@@ -0,0 +1,57 @@
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+#include "alpha.h"
+#include "yuv2rgb.h"
+#include "workers.h"
+
+#define CONVERT_MAX_THREADS 32
+
+// Long-lived frame conversion state. The scaler is only rebuilt when the
+// source or destination geometry/format changes, e.g. on a mid-stream
+// resolution change.
+//
+// Unscaled conversions are split into horizontal bands converted in
+// parallel straight into the destination, one band per thread. swscale
+// needs a context per band for that; scaled conversions use one band.
+typedef struct {
+    struct SwsContext *sws_ctx[CONVERT_MAX_THREADS];
+    int sws_bands;
+    int src_width;
+    int src_height;
+    enum AVPixelFormat src_format;
+    int dst_width;
+    int dst_height;
+    enum AVPixelFormat dst_format;
+
+    // Unscaled 4:2:0 to BGRA goes through a hand-written kernel instead of
+    // swscale. NULL picks the fastest one for this CPU.
+    const YuvKernel *kernel;
+    bool swscale_only;
+    const char *path;      // Kernel (or "swscale") used for the last frame
+
+    // Straight alpha is premultiplied into BGRA output, as wl_shm wants it.
+    // Frames converted with this set are premultiplied already and must not
+    // go through it again.
+    bool premultiply;
+    const PremultiplyKernel *premultiply_kernel;  // NULL picks the fastest
+
+    int threads;           // Requested threads, 0 for one per CPU; may be
+                           // changed between frames
+    int pool_threads;      // Threads in pool, 0 until the first frame
+    WorkerPool pool;
+    int bands;             // Bands used for the last frame
+
+    // Stats
+    unsigned long init_count;
+    double init_time;      // Seconds spent (re)building the scaler
+    unsigned long frame_count;
+    double convert_time;   // Seconds spent converting, excluding init
+} Converter;
+
+int convertFrame(Converter *conv, const AVFrame *frame,
+                 uint8_t *const dst[4], const int dst_linesize[4],
+                 int dst_width, int dst_height, enum AVPixelFormat dst_format);
+AVFrame *convertToFrame(Converter *conv, const AVFrame *frame, enum AVPixelFormat format);
+void freeConverter(Converter *conv);
+// Sets conv->kernel/swscale_only from a kernel name or "swscale"
+int selectConverterPath(Converter *conv, const char *name);
@@ -0,0 +1,177 @@
+#include "damage.h"
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <string.h>
+
+static void setFull(FrameDamage *damage) {
+    damage->full = true;
+    damage->count = 0;
+}
+
+static void unionRect(DamageRect *a, const DamageRect *b) {
+    int right = FFMAX(a->x + a->width, b->x + b->width);
+    int bottom = FFMAX(a->y + a->height, b->y + b->height);
+    a->x = FFMIN(a->x, b->x);
+    a->y = FFMIN(a->y, b->y);
+    a->width = right - a->x;
+    a->height = bottom - a->y;
+}
+
+// Extends a rectangle that rect continues straight down, if there is one,
+// and skips rect if one already covers it
+static void addRect(FrameDamage *damage, const DamageRect *rect) {
+    for (int i = 0; i < damage->count; i++) {
+        DamageRect *r = &damage->rects[i];
+        if (r->x <= rect->x && r->y <= rect->y && r->x + r->width >= rect->x + rect->width &&
+                r->y + r->height >= rect->y + rect->height) {
+            return;
+        }
+        if (r->x == rect->x && r->width == rect->width && r->y + r->height == rect->y) {
+            r->height += rect->height;
+            return;
+        }
+    }
+    if (damage->count < DAMAGE_MAX_RECTS) {
+        damage->rects[damage->count++] = *rect;
+        return;
+    }
+
+    // Out of rectangles, so everything goes into one
+    for (int i = 1; i < damage->count; i++) {
+        unionRect(&damage->rects[0], &damage->rects[i]);
+    }
+    unionRect(&damage->rects[0], rect);
+    damage->count = 1;
+}
+
+// Bytes taken by the first x pixels of a row of plane
+static int planeBytes(enum AVPixelFormat format, int x, int plane) {
+    return x > 0 ? av_image_get_linesize(format, x, plane) : 0;
+}
+
+static int planeShift(const AVPixFmtDescriptor *desc, int plane) {
+    return (plane == 1 || plane == 2) ? desc->log2_chroma_h : 0;
+}
+
+void findDamage(enum AVPixelFormat format, int width, int height,
+                uint8_t *const prev[4], const int prev_linesize[4],
+                uint8_t *const next[4], const int next_linesize[4], FrameDamage *damage) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    damage->full = false;
+    damage->count = 0;
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)) ||
+            width <= 0 || height <= 0) {
+        setFull(damage);
+        return;
+    }
+
+    int planes = av_pix_fmt_count_planes(format);
+    int tiles_x = (width + DAMAGE_TILE - 1) / DAMAGE_TILE;
+    int offsets[4][tiles_x + 1];
+    bool dirty[tiles_x];
+    for (int p = 0; p < planes; p++) {
+        for (int tx = 0; tx <= tiles_x; tx++) {
+            offsets[p][tx] = planeBytes(format, FFMIN(width, tx * DAMAGE_TILE), p);
+        }
+    }
+
+    // A band of tiles at a time, row by row, so that memory is read in
+    // order. A tile is done with at the first difference.
+    for (int y = 0; y < height; y += DAMAGE_TILE) {
+        int band_end = FFMIN(height, y + DAMAGE_TILE);
+        int clean = tiles_x;
+        memset(dirty, 0, sizeof(dirty));
+
+        for (int p = 0; p < planes && clean; p++) {
+            int shift = planeShift(desc, p);
+            for (int row = y >> shift; row < AV_CEIL_RSHIFT(band_end, shift) && clean; row++) {
+                const uint8_t *a = prev[p] + (ptrdiff_t)row * prev_linesize[p];
+                const uint8_t *b = next[p] + (ptrdiff_t)row * next_linesize[p];
+                for (int tx = 0; tx < tiles_x; tx++) {
+                    int start = offsets[p][tx];
+                    if (!dirty[tx] && memcmp(a + start, b + start, offsets[p][tx + 1] - start) != 0) {
+                        dirty[tx] = true;
+                        clean--;
+                    }
+                }
+            }
+        }
+
+        for (int tx = 0; tx < tiles_x;) {
+            if (!dirty[tx]) {
+                tx++;
+                continue;
+            }
+            int first = tx;
+            while (tx < tiles_x && dirty[tx]) {
+                tx++;
+            }
+            DamageRect rect = {
+                first * DAMAGE_TILE, y,
+                FFMIN(width, tx * DAMAGE_TILE) - first * DAMAGE_TILE, band_end - y,
+            };
+            addRect(damage, &rect);
+        }
+    }
+}
+
+void findFrameDamage(const AVFrame *prev, const AVFrame *next, FrameDamage *damage) {
+    if (!prev || prev->format != next->format ||
+            prev->width != next->width || prev->height != next->height) {
+        setFull(damage);
+        return;
+    }
+    findDamage(next->format, next->width, next->height, prev->data, prev->linesize,
+               next->data, next->linesize, damage);
+}
+
+void addFrameDamage(FrameDamage *damage, const FrameDamage *more) {
+    if (damage->full || more->full) {
+        setFull(damage);
+        return;
+    }
+    for (int i = 0; i < more->count; i++) {
+        addRect(damage, &more->rects[i]);
+    }
+}
+
+void dilateFrameDamage(FrameDamage *damage, int border, int width, int height) {
+    if (damage->full) {
+        return;
+    }
+    FrameDamage dilated = { .full = false, .count = 0 };
+    for (int i = 0; i < damage->count; i++) {
+        const DamageRect *r = &damage->rects[i];
+        int x = FFMAX(0, r->x - border);
+        int y = FFMAX(0, r->y - border);
+        DamageRect rect = {
+            x, y,
+            FFMIN(width, r->x + r->width + border) - x, FFMIN(height, r->y + r->height + border) - y,
+        };
+        addRect(&dilated, &rect);
+    }
+    *damage = dilated;
+}
+
+void copyFrameDamage(uint8_t *const dst[4], const int dst_linesize[4], const AVFrame *frame,
+                     const FrameDamage *damage) {
+    DamageRect whole = { 0, 0, frame->width, frame->height };
+    const DamageRect *rects = damage->full ? &whole : damage->rects;
+    int count = damage->full ? 1 : damage->count;
+
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    int planes = av_pix_fmt_count_planes(frame->format);
+    for (int i = 0; i < count; i++) {
+        const DamageRect *rect = &rects[i];
+        for (int p = 0; p < planes; p++) {
+            int shift = planeShift(desc, p);
+            int start = planeBytes(frame->format, rect->x, p);
+            int end = planeBytes(frame->format, rect->x + rect->width, p);
+            int row = rect->y >> shift;
+            int rows = AV_CEIL_RSHIFT(rect->y + rect->height, shift) - row;
+            av_image_copy_plane(dst[p] + (ptrdiff_t)row * dst_linesize[p] + start, dst_linesize[p],
+                                frame->data[p] + (ptrdiff_t)row * frame->linesize[p] + start,
+                                frame->linesize[p], end - start, rows);
+        }
+    }
+}
@@ -0,0 +1,38 @@
+#include <libavutil/frame.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Frames are compared in square tiles of this many pixels. A multiple of
+// every chroma subsampling, so that a tile never splits a chroma sample.
+#define DAMAGE_TILE 64
+#define DAMAGE_MAX_RECTS 16
+
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+} DamageRect;
+
+// What changed between two frames, as whole tiles merged into rectangles.
+// Past DAMAGE_MAX_RECTS they are merged into their bounding box. full means
+// anything may have changed; count 0 that nothing did.
+typedef struct {
+    bool full;
+    int count;
+    DamageRect rects[DAMAGE_MAX_RECTS];
+} FrameDamage;
+
+// Compares two images of the same format and size tile by tile
+void findDamage(enum AVPixelFormat format, int width, int height,
+                uint8_t *const prev[4], const int prev_linesize[4],
+                uint8_t *const next[4], const int next_linesize[4], FrameDamage *damage);
+// The same for frames, everything is damaged if they differ in format or size
+void findFrameDamage(const AVFrame *prev, const AVFrame *next, FrameDamage *damage);
+// Adds more to damage
+void addFrameDamage(FrameDamage *damage, const FrameDamage *more);
+// Grows every rectangle by border pixels on each side, within width x height
+void dilateFrameDamage(FrameDamage *damage, int border, int width, int height);
+// Copies the damaged part of frame into dst, which is laid out the same
+void copyFrameDamage(uint8_t *const dst[4], const int dst_linesize[4], const AVFrame *frame,
+                     const FrameDamage *damage);
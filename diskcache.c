@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "diskcache.h"
+
+#define HASH_SAMPLE (1 << 20)
+#define FNV_OFFSET UINT64_C(0xcbf29ce484222325)
+#define FNV_PRIME UINT64_C(0x100000001b3)
+#define PAGE_ALIGN(x) (((x) + 4095) & ~(uint64_t)4095)
+
+static uint64_t
+fnv1a(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Fills in the source_* fields of header for the file at path */
+static int
+identify_source(const char *path, struct disk_cache_header *header)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    uint8_t *sample = malloc(HASH_SAMPLE);
+    if (fstat(fd, &st) < 0 || !sample) {
+        free(sample);
+        close(fd);
+        return -1;
+    }
+    header->source_size = st.st_size;
+    header->source_mtime_sec = st.st_mtim.tv_sec;
+    header->source_mtime_nsec = st.st_mtim.tv_nsec;
+
+    uint64_t hash = fnv1a(FNV_OFFSET, &header->source_size, sizeof(header->source_size));
+    off_t offsets[2] = { 0, st.st_size > HASH_SAMPLE ? st.st_size - HASH_SAMPLE : 0 };
+    for (int i = 0; i < 2; i++) {
+        ssize_t n = pread(fd, sample, HASH_SAMPLE, offsets[i]);
+        if (n < 0) {
+            free(sample);
+            close(fd);
+            return -1;
+        }
+        hash = fnv1a(hash, sample, n);
+    }
+    header->source_hash = hash;
+
+    free(sample);
+    close(fd);
+    return 0;
+}
+
+/* One cache file per source, named after its absolute path */
+static char *
+cache_path(const char *dir, const char *source)
+{
+    char *real = realpath(source, NULL);
+    if (!real)
+        return NULL;
+    uint64_t hash = fnv1a(FNV_OFFSET, real, strlen(real));
+    free(real);
+
+    char *path;
+    if (asprintf(&path, "%s/%016" PRIx64 ".frames", dir, hash) < 0)
+        return NULL;
+    return path;
+}
+
+static bool
+header_valid(const struct disk_cache_header *header,
+        const struct disk_cache_header *source, off_t file_size)
+{
+    if (memcmp(header->magic, DISK_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != DISK_CACHE_VERSION)
+        return false;
+    if (header->source_size != source->source_size ||
+            header->source_mtime_sec != source->source_mtime_sec ||
+            header->source_mtime_nsec != source->source_mtime_nsec ||
+            header->source_hash != source->source_hash)
+        return false;
+
+    /* Don't trust the layout of a file we can't vouch for either */
+    if (header->frame_count == 0 || header->frame_count > INT32_MAX / sizeof(struct disk_cache_frame) ||
+            header->width == 0 || header->height == 0 ||
+            header->stride < (uint64_t)header->width * 4 ||
+            header->frame_size != (uint64_t)header->stride * header->height ||
+            header->data_offset < sizeof(*header) + header->frame_count * sizeof(struct disk_cache_frame) ||
+            header->time_base_num <= 0 || header->time_base_den <= 0 ||
+            header->frame_rate_num <= 0 || header->frame_rate_den <= 0)
+        return false;
+    /* Frames are only ever cached as 32-bit RGB */
+    if (header->format != WL_SHM_FORMAT_ARGB8888 &&
+            header->format != WL_SHM_FORMAT_XRGB8888)
+        return false;
+    /* Divided rather than multiplied, so that nothing can wrap */
+    return (uint64_t)file_size >= header->data_offset &&
+        header->frame_count <= ((uint64_t)file_size - header->data_offset) / header->frame_size;
+}
+
+static bool
+rect_valid(const struct disk_cache_header *header, int32_t x, int32_t y,
+        int32_t width, int32_t height)
+{
+    return x >= 0 && y >= 0 && width >= 0 && height >= 0 &&
+        (int64_t)x + width <= header->width && (int64_t)y + height <= header->height;
+}
+
+/* Every box and damage rectangle has to lie within the frame, they go
+ * straight to the compositor and to copies */
+static bool
+frames_valid(const struct disk_cache_header *header,
+        const struct disk_cache_frame *frames)
+{
+    for (uint32_t i = 0; i < header->frame_count; i++) {
+        const struct disk_cache_frame *frame = &frames[i];
+        if (!rect_valid(header, frame->box_x, frame->box_y,
+                    frame->box_width, frame->box_height) ||
+                frame->damage_count < -1 || frame->damage_count > DISK_CACHE_DAMAGE_RECTS)
+            return false;
+        for (int j = 0; j < frame->damage_count; j++) {
+            if (!rect_valid(header, frame->damage[j][0], frame->damage[j][1],
+                        frame->damage[j][2], frame->damage[j][3]))
+                return false;
+        }
+    }
+    return true;
+}
+
+/* Looks for an up to date cache of source in dir. Returns 0 with the
+ * header and frame table loaded, or -1 if there is none to use. */
+int
+disk_cache_open(struct disk_cache *cache, const char *dir, const char *source)
+{
+    struct disk_cache_header current = { 0 };
+    struct stat st;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->fd = -1;
+    cache->path = cache_path(dir, source);
+    if (!cache->path || identify_source(source, &current) < 0)
+        goto fail;
+
+    /* The compositor maps the pool read-write, so it has to be opened so */
+    cache->fd = open(cache->path, O_RDWR | O_CLOEXEC);
+    if (cache->fd < 0)
+        goto fail;
+
+    struct disk_cache_header *header = &cache->header;
+    if (pread(cache->fd, header, sizeof(*header), 0) != sizeof(*header) ||
+            fstat(cache->fd, &st) < 0 || !header_valid(header, &current, st.st_size)) {
+        fprintf(stderr, "Frame cache %s is out of date\n", cache->path);
+        goto fail;
+    }
+
+    size_t table_size = header->frame_count * sizeof(struct disk_cache_frame);
+    cache->frames = malloc(table_size);
+    if (!cache->frames ||
+            pread(cache->fd, cache->frames, table_size, sizeof(*header)) != (ssize_t)table_size)
+        goto fail;
+    if (!frames_valid(header, cache->frames)) {
+        fprintf(stderr, "Frame cache %s has a broken frame table\n", cache->path);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    disk_cache_close(cache);
+    return -1;
+}
+
+/* Starts a new cache for source with the geometry, timing and frame count
+ * of layout. The file is created under a temporary name and sized up
+ * front; the caller fills in the frames (through the fd from
+ * data_offset on) and cache->frames, then calls disk_cache_commit(). */
+int
+disk_cache_create(struct disk_cache *cache, const char *dir, const char *source,
+        const struct disk_cache_header *layout)
+{
+    memset(cache, 0, sizeof(*cache));
+    cache->fd = -1;
+
+    struct disk_cache_header *header = &cache->header;
+    *header = *layout;
+    /* The magic is only written once everything else is in place */
+    memset(header->magic, 0, sizeof(header->magic));
+    header->version = DISK_CACHE_VERSION;
+    header->frame_size = (uint64_t)header->stride * header->height;
+    header->data_offset = PAGE_ALIGN(sizeof(*header) +
+            header->frame_count * sizeof(struct disk_cache_frame));
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Could not create cache directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    cache->path = cache_path(dir, source);
+    if (!cache->path || identify_source(source, header) < 0 ||
+            asprintf(&cache->tmp_path, "%s.XXXXXX", cache->path) < 0) {
+        cache->tmp_path = NULL;
+        disk_cache_close(cache);
+        return -1;
+    }
+
+    cache->fd = mkostemp(cache->tmp_path, O_CLOEXEC);
+    if (cache->fd < 0) {
+        fprintf(stderr, "Could not create %s: %s\n", cache->tmp_path, strerror(errno));
+        free(cache->tmp_path);
+        cache->tmp_path = NULL;
+        disk_cache_close(cache);
+        return -1;
+    }
+
+    /* Reserve the blocks now: running out of disk while writing through
+     * a mapping would be a SIGBUS rather than an error */
+    off_t size = header->data_offset + header->frame_size * header->frame_count;
+    int ret = posix_fallocate(cache->fd, 0, size);
+    cache->frames = calloc(header->frame_count, sizeof(struct disk_cache_frame));
+    if (ret != 0 || !cache->frames) {
+        fprintf(stderr, "Could not allocate %jd MiB for the frame cache: %s\n",
+                (intmax_t)(size >> 20), strerror(ret ? ret : ENOMEM));
+        disk_cache_close(cache);
+        return -1;
+    }
+    return 0;
+}
+
+/* Writes the frame table and header and moves the file into place */
+int
+disk_cache_commit(struct disk_cache *cache)
+{
+    struct disk_cache_header *header = &cache->header;
+    size_t table_size = header->frame_count * sizeof(struct disk_cache_frame);
+
+    if (pwrite(cache->fd, cache->frames, table_size, sizeof(*header)) != (ssize_t)table_size)
+        goto fail;
+    /* A valid header must never reach the disk ahead of the frames */
+    if (fdatasync(cache->fd) < 0)
+        goto fail;
+    memcpy(header->magic, DISK_CACHE_MAGIC, sizeof(header->magic));
+    if (pwrite(cache->fd, header, sizeof(*header), 0) != sizeof(*header) ||
+            fdatasync(cache->fd) < 0 ||
+            rename(cache->tmp_path, cache->path) < 0)
+        goto fail;
+
+    free(cache->tmp_path);
+    cache->tmp_path = NULL;
+    return 0;
+
+fail:
+    fprintf(stderr, "Could not write frame cache %s: %s\n", cache->path, strerror(errno));
+    return -1;
+}
+
+/* Also throws away a cache that was created but never committed */
+void
+disk_cache_close(struct disk_cache *cache)
+{
+    if (cache->tmp_path)
+        unlink(cache->tmp_path);
+    if (cache->fd >= 0)
+        close(cache->fd);
+    free(cache->tmp_path);
+    free(cache->path);
+    free(cache->frames);
+    memset(cache, 0, sizeof(*cache));
+    cache->fd = -1;
+}
@@ -0,0 +1,64 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Ready-to-display frames of one video kept on disk between runs.
+ *
+ * The file is a page-aligned header followed by the frames back to back,
+ * exactly the layout of a preloaded wl_shm_pool, so its fd is handed to
+ * the compositor as is and frames go from the page cache to the screen
+ * without being read or copied by us. All fields are host-endian; a cache
+ * is only ever read back on the machine that wrote it. */
+
+#define DISK_CACHE_MAGIC "WLVFRAME"
+#define DISK_CACHE_VERSION 3
+#define DISK_CACHE_DAMAGE_RECTS 16
+
+struct disk_cache_frame {
+    int64_t pts;        /* In time_base units, from 0 at the first frame */
+    int64_t duration;
+    /* The part that isn't fully transparent, and whether all of it is
+     * fully opaque; the whole frame for video without alpha */
+    int32_t box_x, box_y, box_width, box_height;
+    uint32_t box_opaque;
+    /* What changed since the frame before, or the last one for the first:
+     * damage_count rectangles of x, y, width, height, -1 for everything */
+    int32_t damage_count;
+    int32_t damage[DISK_CACHE_DAMAGE_RECTS][4];
+};
+
+struct disk_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t width, height, stride;
+    uint32_t format;            /* WL_SHM_FORMAT_* */
+    uint32_t frame_count;
+    uint64_t frame_size;
+    uint64_t data_offset;       /* Header and frame table, page aligned */
+    int32_t time_base_num, time_base_den;
+    int32_t frame_rate_num, frame_rate_den;
+    int64_t duration;           /* Of one loop, in time_base units */
+
+    /* The source the frames came from. Size and mtime catch nearly every
+     * change; the hash of its first and last MiB catches the rest without
+     * reading a whole 4K clip on every start. */
+    uint64_t source_size;
+    int64_t source_mtime_sec;
+    int64_t source_mtime_nsec;
+    uint64_t source_hash;
+    /* Followed by frame_count struct disk_cache_frame */
+};
+
+struct disk_cache {
+    int fd;
+    char *path;
+    char *tmp_path;     /* Set while a new cache is being written */
+    struct disk_cache_header header;
+    struct disk_cache_frame *frames;
+};
+
+int disk_cache_open(struct disk_cache *cache, const char *dir, const char *source);
+int disk_cache_create(struct disk_cache *cache, const char *dir, const char *source,
+        const struct disk_cache_header *layout);
+int disk_cache_commit(struct disk_cache *cache);
+void disk_cache_close(struct disk_cache *cache);
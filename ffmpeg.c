@@ -1,26 +1,85 @@
 #include "ffmpeg.h"
+#include "workers.h"
+#include "framearena.h"
+#include <libavutil/cpu.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
 
-FrameArray getFrames(const char *inputfile) {
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+// Accepts "auto", "frame", "slice", a thread count, or "frame:N"/"slice:N"
+int parseDecoderThreading(const char *spec, DecoderThreading *threading) {
+    const char *count = spec;
+    threading->thread_type = 0;
+    threading->thread_count = 0;
+
+    if (strcmp(spec, "auto") == 0) {
+        return 0;
+    }
+    if (strncmp(spec, "frame", 5) == 0) {
+        threading->thread_type = FF_THREAD_FRAME;
+        count = spec + 5;
+    } else if (strncmp(spec, "slice", 5) == 0) {
+        threading->thread_type = FF_THREAD_SLICE;
+        count = spec + 5;
+    }
+    if (threading->thread_type) {
+        if (*count == '\0') {
+            return 0;
+        }
+        if (*count != ':') {
+            return -1;
+        }
+        count++;
+    }
+
+    char *end;
+    long n = strtol(count, &end, 10);
+    if (end == count || *end != '\0' || n < 1 || n > 256) {
+        return -1;
+    }
+    threading->thread_count = n;
+    return 0;
+}
+
+const char *threadTypeName(int thread_type) {
+    if (thread_type & FF_THREAD_FRAME)
+        return "frame";
+    if (thread_type & FF_THREAD_SLICE)
+        return "slice";
+    return "no";
+}
+
+double decodeFps(const DecodeStats *stats) {
+    unsigned long long ns = atomic_load_explicit(&stats->decode_ns, memory_order_relaxed);
+    unsigned long frames = atomic_load_explicit(&stats->frames, memory_order_relaxed);
+    return ns > 0 ? frames * 1e9 / ns : 0;
+}
+
+VideoDecoder *openDecoder(const char *inputfile, const DecoderThreading *threading) {
     AVFormatContext *format_ctx = NULL;
     AVCodecContext *codec_ctx = NULL;
     const AVCodec *codec = NULL;
-    AVFrame *frame = NULL;
-    AVPacket packet;
-    FrameArray frame_array = {NULL, 0};
-    int ret;
 
     // Open the input file
     if (avformat_open_input(&format_ctx, inputfile, NULL, NULL) < 0) {
         fprintf(stderr, "Failed to open input file\n");
-        return frame_array;
+        return NULL;
     }
 
     // Retrieve stream information
     if (avformat_find_stream_info(format_ctx, NULL) < 0) {
         fprintf(stderr, "Failed to retrieve stream information\n");
         avformat_close_input(&format_ctx);
-        return frame_array;
+        return NULL;
     }
 
     // Find the first video stream
@@ -35,7 +94,7 @@ FrameArray getFrames(const char *inputfile) {
     if (video_stream_index == -1) {
         fprintf(stderr, "No video stream found in the input file\n");
         avformat_close_input(&format_ctx);
-        return frame_array;
+        return NULL;
     }
 
     // Allocate codec context
@@ -43,7 +102,7 @@ FrameArray getFrames(const char *inputfile) {
     if (!codec_ctx) {
         fprintf(stderr, "Failed to allocate codec context\n");
         avformat_close_input(&format_ctx);
-        return frame_array;
+        return NULL;
     }
 
     // Copy codec parameters from stream
@@ -51,7 +110,7 @@ FrameArray getFrames(const char *inputfile) {
         fprintf(stderr, "Failed to copy codec parameters to context\n");
         avcodec_free_context(&codec_ctx);
         avformat_close_input(&format_ctx);
-        return frame_array;
+        return NULL;
     }
 
     // Find the decoder for the codec
@@ -60,7 +119,14 @@ FrameArray getFrames(const char *inputfile) {
         fprintf(stderr, "Codec not found\n");
         avcodec_free_context(&codec_ctx);
         avformat_close_input(&format_ctx);
-        return frame_array;
+        return NULL;
+    }
+
+    // libavcodec decodes on a single thread unless told otherwise, and the
+    // threading setup has to be in place before the codec is opened
+    codec_ctx->thread_count = threading ? threading->thread_count : 0;
+    if (threading && threading->thread_type) {
+        codec_ctx->thread_type = threading->thread_type;
     }
 
     // Open codec
@@ -68,55 +134,635 @@ FrameArray getFrames(const char *inputfile) {
         fprintf(stderr, "Failed to open codec\n");
         avcodec_free_context(&codec_ctx);
         avformat_close_input(&format_ctx);
-        return frame_array;
+        return NULL;
+    }
+
+    VideoDecoder *decoder = calloc(1, sizeof(VideoDecoder));
+    decoder->packet = av_packet_alloc();
+    if (!decoder->packet) {
+        fprintf(stderr, "Failed to allocate packet\n");
+        free(decoder);
+        avcodec_free_context(&codec_ctx);
+        avformat_close_input(&format_ctx);
+        return NULL;
+    }
+    decoder->format_ctx = format_ctx;
+    decoder->codec_ctx = codec_ctx;
+    decoder->video_stream_index = video_stream_index;
+
+    AVStream *stream = format_ctx->streams[video_stream_index];
+    decoder->time_base = stream->time_base;
+    decoder->frame_rate = av_guess_frame_rate(format_ctx, stream, NULL);
+    if (decoder->frame_rate.num <= 0 || decoder->frame_rate.den <= 0) {
+        decoder->frame_rate = (AVRational){ 30, 1 }; // Fallback to 30 FPS
+    }
+    decoder->frame_duration = av_rescale_q(1, av_inv_q(decoder->frame_rate), decoder->time_base);
+    if (decoder->frame_duration <= 0) {
+        decoder->frame_duration = 1;
+    }
+    decoder->start_pts = AV_NOPTS_VALUE;
+
+    decoder->stats.codec = codec->name;
+    decoder->stats.thread_type = codec_ctx->active_thread_type;
+    decoder->stats.thread_count = codec_ctx->active_thread_type ? codec_ctx->thread_count : 1;
+    decoder->stats.decoders = 1;
+    atomic_init(&decoder->stats.frames, 0);
+    atomic_init(&decoder->stats.decode_ns, 0);
+
+    return decoder;
+}
+
+// Rewrites the frame's timing so pts counts from 0 at the start of the
+// clip and keeps increasing across loops, and every frame has a duration.
+// Variable frame rate content keeps its own per-frame timing.
+static void setFrameTiming(VideoDecoder *decoder, AVFrame *frame) {
+    int64_t pts = frame->best_effort_timestamp;
+    if (pts == AV_NOPTS_VALUE) {
+        pts = decoder->start_pts == AV_NOPTS_VALUE ? 0 : decoder->end_pts;
+    }
+    if (frame->duration <= 0) {
+        frame->duration = decoder->frame_duration;
+    }
+
+    if (decoder->start_pts == AV_NOPTS_VALUE) {
+        decoder->start_pts = pts;
+        decoder->end_pts = pts;
     }
+    decoder->end_pts = FFMAX(decoder->end_pts, pts + frame->duration);
+
+    frame->pts = pts - decoder->start_pts + decoder->loop_offset;
+}
 
-    frame_array.frame_rate = av_q2d(codec_ctx->framerate);
-    if (frame_array.frame_rate <= 0) {
-        frame_array.frame_rate = 30.0; // Fallback to 30 FPS
+// Next packet of the input, from memory once the packets are cached
+static int readPacket(VideoDecoder *decoder) {
+    if (!decoder->packets) {
+        return av_read_frame(decoder->format_ctx, decoder->packet);
+    }
+    if (decoder->next_packet == decoder->packet_count) {
+        return AVERROR_EOF;
     }
-    
+    return av_packet_ref(decoder->packet, decoder->packets[decoder->next_packet++]);
+}
+
+// Returns 0 with the next frame in presentation order, AVERROR_EOF once
+// the decoder has been fully drained, or another negative error
+int decodeNextFrame(VideoDecoder *decoder, AVFrame *frame) {
+    uint64_t start = now_ns();
+    int ret;
+
+    while ((ret = avcodec_receive_frame(decoder->codec_ctx, frame)) == AVERROR(EAGAIN)) {
+        if (readPacket(decoder) < 0) {
+            // End of input, flush out the frames the decoder is still holding
+            if (decoder->draining)
+                return AVERROR_EOF;
+            decoder->draining = 1;
+            avcodec_send_packet(decoder->codec_ctx, NULL);
+            continue;
+        }
+
+        if (decoder->packet->stream_index == decoder->video_stream_index) {
+            if (avcodec_send_packet(decoder->codec_ctx, decoder->packet) < 0) {
+                fprintf(stderr, "Error sending packet to decoder\n");
+            }
+        }
+        av_packet_unref(decoder->packet);
+    }
+
+    if (ret >= 0) {
+        setFrameTiming(decoder, frame);
+        atomic_fetch_add_explicit(&decoder->stats.frames, 1, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&decoder->stats.decode_ns, now_ns() - start, memory_order_relaxed);
+    return ret;
+}
+
+// Timestamp a packet is sought by, as in Keyframe.seek_ts
+static int64_t packetSeekTs(const AVPacket *packet) {
+    return packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+}
+
+// Moves to the keyframe at or before ts, in stream time_base units, or to
+// the start of the stream for AV_NOPTS_VALUE. Frames keep their place on
+// the clip's timeline, unlike after rewindDecoder().
+int seekDecoder(VideoDecoder *decoder, int64_t ts) {
+    if (decoder->packets) {
+        int next = 0;
+        for (int i = 0; ts != AV_NOPTS_VALUE && i < decoder->packet_count; i++) {
+            const AVPacket *packet = decoder->packets[i];
+            if (packetSeekTs(packet) > ts)
+                break;
+            if (packet->flags & AV_PKT_FLAG_KEY)
+                next = i;
+        }
+        decoder->next_packet = next;
+        avcodec_flush_buffers(decoder->codec_ctx);
+        decoder->draining = 0;
+        return 0;
+    }
+
+    if (ts == AV_NOPTS_VALUE) {
+        AVStream *stream = decoder->format_ctx->streams[decoder->video_stream_index];
+        ts = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+    }
+
+    if (av_seek_frame(decoder->format_ctx, decoder->video_stream_index, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+        fprintf(stderr, "Failed to seek in the input\n");
+        return -1;
+    }
+    avcodec_flush_buffers(decoder->codec_ctx);
+    decoder->draining = 0;
+    return 0;
+}
+
+// Reads the whole video stream into memory, from where the decoder takes
+// its packets from now on. Compressed, a loop is small next to even a few
+// of its decoded frames, and looping from memory never waits on the disk
+// or the demuxer. Call before decoding anything.
+int cachePackets(VideoDecoder *decoder) {
+    int capacity = 0;
+    int ret;
+
+    while ((ret = av_read_frame(decoder->format_ctx, decoder->packet)) >= 0) {
+        if (decoder->packet->stream_index != decoder->video_stream_index) {
+            av_packet_unref(decoder->packet);
+            continue;
+        }
+        if (decoder->packet_count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            AVPacket **packets = (AVPacket **)realloc(decoder->packets, capacity * sizeof(AVPacket *));
+            if (!packets) {
+                break;
+            }
+            decoder->packets = packets;
+        }
+        AVPacket *packet = av_packet_alloc();
+        if (!packet) {
+            break;
+        }
+        av_packet_move_ref(packet, decoder->packet);
+        decoder->packets[decoder->packet_count++] = packet;
+        decoder->packet_bytes += packet->size;
+    }
+    av_packet_unref(decoder->packet);
+
+    if (ret != AVERROR_EOF || decoder->packet_count == 0) {
+        fprintf(stderr, "Failed to read the packets into memory\n");
+        for (int i = 0; i < decoder->packet_count; i++) {
+            av_packet_free(&decoder->packets[i]);
+        }
+        free(decoder->packets);
+        decoder->packets = NULL;
+        decoder->packet_count = 0;
+        decoder->packet_bytes = 0;
+        seekDecoder(decoder, AV_NOPTS_VALUE);
+        return -1;
+    }
+    decoder->next_packet = 0;
+    return 0;
+}
+
+int rewindDecoder(VideoDecoder *decoder) {
+    if (seekDecoder(decoder, AV_NOPTS_VALUE) < 0) {
+        return -1;
+    }
+
+    // The next pass follows on from the end of this one
+    if (decoder->start_pts != AV_NOPTS_VALUE) {
+        decoder->loop_offset += decoder->end_pts - decoder->start_pts;
+    }
+    return 0;
+}
+
+void closeDecoder(VideoDecoder **decoder) {
+    if (!*decoder)
+        return;
+    av_packet_free(&(*decoder)->packet);
+    for (int i = 0; i < (*decoder)->packet_count; i++) {
+        av_packet_free(&(*decoder)->packets[i]);
+    }
+    free((*decoder)->packets);
+    avcodec_free_context(&(*decoder)->codec_ctx);
+    avformat_close_input(&(*decoder)->format_ctx);
+    free(*decoder);
+    *decoder = NULL;
+}
+
+// Keeps a decoded frame, copied into its arena slot if it fits there.
+// Returns the frame to decode into next: the same one emptied if it was
+// copied, a new one if it was kept as is.
+static AVFrame *keepFrame(FrameArena *arena, int slot, AVFrame *frame, AVFrame **kept) {
+    AVFrame *packed = arenaCopyFrame(arena, slot, frame);
+    if (packed) {
+        *kept = packed;
+        av_frame_unref(frame);
+        return frame;
+    }
+    *kept = frame;
+    return av_frame_alloc();
+}
+
+static FrameArray getFramesSerial(const char *inputfile, const DecoderThreading *threading,
+                                  FrameArena *arena) {
+    FrameArray frame_array = {NULL, 0};
+
+    VideoDecoder *decoder = openDecoder(inputfile, threading);
+    if (!decoder) {
+        return frame_array;
+    }
+    frame_array.frame_rate = decoder->frame_rate;
+    frame_array.time_base = decoder->time_base;
+
     // Allocate initial array for frames
     int allocated_frames = 10;
     frame_array.frames = (AVFrame **)malloc(sizeof(AVFrame *) * allocated_frames);
 
     // Read frames
-    while (av_read_frame(format_ctx, &packet) >= 0) {
-        if (packet.stream_index == video_stream_index) {
-            ret = avcodec_send_packet(codec_ctx, &packet);
-            if (ret < 0) {
-                fprintf(stderr, "Error sending packet to decoder\n");
-                av_packet_unref(&packet);
-                continue;
-            }
+    AVFrame *frame = av_frame_alloc();
+    while (frame && decodeNextFrame(decoder, frame) >= 0) {
+        // Store the frame
+        if (frame_array.frame_count >= allocated_frames) {
+            allocated_frames *= 2;
+            frame_array.frames = (AVFrame **)realloc(frame_array.frames, sizeof(AVFrame *) * allocated_frames);
+        }
+        frame = keepFrame(arena, frame_array.frame_count, frame, &frame_array.frames[frame_array.frame_count]);
+        frame_array.frame_count++;
+    }
+    av_frame_free(&frame);
+    if (decoder->start_pts != AV_NOPTS_VALUE) {
+        frame_array.duration = decoder->end_pts - decoder->start_pts;
+    }
+    frame_array.decode_stats.codec = decoder->stats.codec;
+    frame_array.decode_stats.thread_type = decoder->stats.thread_type;
+    frame_array.decode_stats.thread_count = decoder->stats.thread_count;
+    frame_array.decode_stats.decoders = 1;
+    atomic_init(&frame_array.decode_stats.frames, atomic_load(&decoder->stats.frames));
+    atomic_init(&frame_array.decode_stats.decode_ns, atomic_load(&decoder->stats.decode_ns));
+
+    // Clean up
+    closeDecoder(&decoder);
+
+    return frame_array;
+}
 
-            while ((ret = avcodec_receive_frame(codec_ctx, frame = av_frame_alloc())) >= 0) {
-                // Store the frame
-                if (frame_array.frame_count >= allocated_frames) {
-                    allocated_frames *= 2;
-                    frame_array.frames = (AVFrame **)realloc(frame_array.frames, sizeof(AVFrame *) * allocated_frames);
-                }
-                frame_array.frames[frame_array.frame_count++] = frame;
+// A run of whole GOPs decoded by its own decoder. It keeps the frames with
+// start <= pts < end, pts counting from the start of the clip; the last
+// segment runs to the end of the file.
+typedef struct {
+    int first_keyframe;
+    int64_t seek_ts;        // AV_NOPTS_VALUE to decode from the start of the file
+    int64_t start;
+    int64_t end;
+    AVFrame **frames;
+    int frame_count;
+    int64_t end_pts;        // End of the last frame decoded
+    DecodeStats stats;
+    bool failed;
+} GopSegment;
+
+typedef struct {
+    const char *inputfile;
+    DecoderThreading threading;
+    const KeyframeIndex *index;
+    FrameArena *arena;
+    int64_t first_pts;
+    GopSegment *segments;
+} GopDecode;
+
+static int comparePts(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
 
-                // Allocate a new frame for the next decode
-                frame = av_frame_alloc();
+int indexKeyframes(const char *inputfile, KeyframeIndex *index) {
+    memset(index, 0, sizeof(*index));
+    index->first_pts = AV_NOPTS_VALUE;
+
+    // The codec is never fed, so keep it from starting threads
+    VideoDecoder *decoder = openDecoder(inputfile, &(DecoderThreading){ .thread_count = 1 });
+    if (!decoder) {
+        return -1;
+    }
+    index->frame_rate = decoder->frame_rate;
+    index->time_base = decoder->time_base;
+    index->width = decoder->codec_ctx->width;
+    index->height = decoder->codec_ctx->height;
+    index->format = decoder->codec_ctx->pix_fmt;
+
+    int allocated_keyframes = 0;
+    int allocated_frames = 0;
+    int64_t end_pts = AV_NOPTS_VALUE;
+    int ret = 0;
+    while (av_read_frame(decoder->format_ctx, decoder->packet) >= 0) {
+        AVPacket *packet = decoder->packet;
+        if (packet->stream_index != decoder->video_stream_index) {
+            av_packet_unref(packet);
+            continue;
+        }
+        // Without timestamps there is no telling which frame is which
+        if (packet->pts == AV_NOPTS_VALUE) {
+            av_packet_unref(packet);
+            ret = -1;
+            break;
+        }
+
+        if (index->first_pts == AV_NOPTS_VALUE || packet->pts < index->first_pts) {
+            index->first_pts = packet->pts;
+        }
+        int64_t duration = packet->duration > 0 ? packet->duration : decoder->frame_duration;
+        end_pts = end_pts == AV_NOPTS_VALUE ? packet->pts + duration : FFMAX(end_pts, packet->pts + duration);
+
+        if (packet->flags & AV_PKT_FLAG_KEY) {
+            if (index->count >= allocated_keyframes) {
+                allocated_keyframes = allocated_keyframes ? allocated_keyframes * 2 : 64;
+                index->keyframes = (Keyframe *)realloc(index->keyframes, sizeof(Keyframe) * allocated_keyframes);
             }
+            index->keyframes[index->count++] = (Keyframe){
+                .seek_ts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts,
+                .pts = packet->pts,
+                .packet = index->packet_count,
+            };
+        }
+        if (index->packet_count >= allocated_frames) {
+            allocated_frames = allocated_frames ? allocated_frames * 2 : 256;
+            index->frame_pts = (int64_t *)realloc(index->frame_pts, sizeof(int64_t) * allocated_frames);
+        }
+        index->frame_pts[index->packet_count++] = packet->pts;
+        av_packet_unref(packet);
+    }
+    closeDecoder(&decoder);
+
+    if (ret < 0 || index->packet_count == 0) {
+        freeKeyframeIndex(index);
+        return -1;
+    }
+
+    // One frame per packet, put into presentation order on the clip's timeline
+    qsort(index->frame_pts, index->packet_count, sizeof(int64_t), comparePts);
+    for (int i = 0; i < index->packet_count; i++) {
+        index->frame_pts[i] -= index->first_pts;
+    }
+    for (int i = 0; i < index->count; i++) {
+        index->keyframes[i].frame = frameAtPts(index, index->keyframes[i].pts - index->first_pts);
+    }
+    index->duration = end_pts - index->first_pts;
+    return 0;
+}
+
+// The last frame presented at or before pts, counted from the clip start
+int frameAtPts(const KeyframeIndex *index, int64_t pts) {
+    int lo = 0;
+    int hi = index->packet_count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (index->frame_pts[mid] <= pts)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+// The keyframe to start decoding from to get to frame
+int keyframeBefore(const KeyframeIndex *index, int frame) {
+    int lo = 0;
+    int hi = index->count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (index->keyframes[mid].frame <= frame)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+void freeKeyframeIndex(KeyframeIndex *index) {
+    free(index->keyframes);
+    free(index->frame_pts);
+    index->keyframes = NULL;
+    index->frame_pts = NULL;
+    index->count = 0;
+    index->packet_count = 0;
+}
+
+// Groups the GOPs into at most max_segments segments of roughly the same
+// number of packets and returns how many there are
+static int planSegments(const KeyframeIndex *index, int max_segments, GopSegment *segments) {
+    int count = 0;
+    int next = 0;
+
+    for (int i = 0; i < max_segments && next < index->count; i++) {
+        int64_t target = (int64_t)index->packet_count * i / max_segments;
+        while (next < index->count - 1 && index->keyframes[next].packet < target) {
+            next++;
+        }
+        if (count > 0 && next <= segments[count - 1].first_keyframe) {
+            continue;
+        }
+        segments[count++].first_keyframe = next;
+    }
+
+    for (int i = 0; i < count; i++) {
+        const Keyframe *key = &index->keyframes[segments[i].first_keyframe];
+        segments[i].seek_ts = i == 0 ? AV_NOPTS_VALUE : key->seek_ts;
+        segments[i].start = i == 0 ? INT64_MIN : key->pts - index->first_pts;
+        segments[i].end = i == count - 1 ? INT64_MAX :
+            index->keyframes[segments[i + 1].first_keyframe].pts - index->first_pts;
+    }
+    return count;
+}
+
+static void decodeSegment(void *arg, int job) {
+    GopDecode *gop = arg;
+    GopSegment *segment = &gop->segments[job];
+
+    VideoDecoder *decoder = openDecoder(gop->inputfile, &gop->threading);
+    if (!decoder) {
+        segment->failed = true;
+        return;
+    }
+    // Every segment counts pts from the start of the clip rather than from
+    // wherever it started decoding
+    decoder->start_pts = gop->first_pts;
+    decoder->end_pts = gop->first_pts;
+
+    // Seeking lands on the keyframe, or an earlier one if the demuxer
+    // indexes by pts; either way the frames before start are skipped
+    if (segment->seek_ts != AV_NOPTS_VALUE && seekDecoder(decoder, segment->seek_ts) < 0) {
+        segment->failed = true;
+        closeDecoder(&decoder);
+        return;
+    }
+
+    int allocated_frames = 0;
+    AVFrame *frame = av_frame_alloc();
+    while (frame) {
+        int ret = decodeNextFrame(decoder, frame);
+        if (ret < 0) {
+            segment->failed = ret != AVERROR_EOF;
+            break;
+        }
+        // Frames come out in presentation order, so the first one past the
+        // end means the rest belong to the next segment. Leading frames of
+        // an open GOP are still decoded here, before the next keyframe.
+        if (frame->pts >= segment->end) {
+            break;
+        }
+        if (frame->pts < segment->start) {
+            av_frame_unref(frame);
+            continue;
+        }
+
+        if (segment->frame_count >= allocated_frames) {
+            allocated_frames = allocated_frames ? allocated_frames * 2 : 64;
+            segment->frames = (AVFrame **)realloc(segment->frames, sizeof(AVFrame *) * allocated_frames);
+        }
+        // Segments finish out of order, the arena keeps frames in order
+        frame = keepFrame(gop->arena, frameAtPts(gop->index, frame->pts), frame,
+                          &segment->frames[segment->frame_count]);
+        segment->frame_count++;
+    }
+    if (!frame) {
+        segment->failed = true;
+    }
+    av_frame_free(&frame);
+
+    segment->end_pts = decoder->end_pts - gop->first_pts;
+    segment->stats.codec = decoder->stats.codec;
+    segment->stats.thread_type = decoder->stats.thread_type;
+    segment->stats.thread_count = decoder->stats.thread_count;
+    closeDecoder(&decoder);
+}
+
+// Decodes GOP-aligned segments of the clip on separate decoders at the
+// same time, then strings the frames together in order. Returns -1 without
+// touching frame_array if the clip can't be split or a segment fails, in
+// which case the caller decodes it serially.
+// start is when getFrames() began, so that the time reported includes
+// indexing, which is what startup actually costs
+static int getFramesParallel(const char *inputfile, const DecoderThreading *threading, int workers,
+                             const KeyframeIndex *index, FrameArena *arena, uint64_t start,
+                             FrameArray *frame_array) {
+    int ret = -1;
+
+    if (index->count < 2) {
+        return -1;
+    }
+
+    // A few segments per worker so that uneven GOPs still balance out
+    workers = FFMIN(workers, index->count);
+    int max_segments = FFMIN(index->count, workers * 4);
+    GopDecode gop = {
+        .inputfile = inputfile,
+        .threading = threading ? *threading : (DecoderThreading){ 0 },
+        .index = index,
+        .arena = arena,
+        .first_pts = index->first_pts,
+        .segments = (GopSegment *)calloc(max_segments, sizeof(GopSegment)),
+    };
+    int segment_count = planSegments(index, max_segments, gop.segments);
+    // Share the CPUs between the decoders instead of each taking them all
+    if (gop.threading.thread_count == 0) {
+        gop.threading.thread_count = FFMAX(1, av_cpu_count() / workers);
+    }
+
+    WorkerPool pool;
+    if (initWorkerPool(&pool, workers) == 0) {
+        runWorkerPool(&pool, decodeSegment, &gop, segment_count);
+        freeWorkerPool(&pool);
+
+        int frame_count = 0;
+        bool failed = false;
+        for (int i = 0; i < segment_count; i++) {
+            frame_count += gop.segments[i].frame_count;
+            failed |= gop.segments[i].failed;
+        }
 
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-                av_packet_unref(&packet);
-                continue;
+        if (failed || frame_count == 0) {
+            fprintf(stderr, "Parallel decode failed, decoding serially instead\n");
+        } else {
+            *frame_array = (FrameArray){ .frames = NULL, .frame_count = 0 };
+            frame_array->frames = (AVFrame **)malloc(sizeof(AVFrame *) * frame_count);
+            for (int i = 0; i < segment_count; i++) {
+                memcpy(frame_array->frames + frame_array->frame_count, gop.segments[i].frames,
+                       sizeof(AVFrame *) * gop.segments[i].frame_count);
+                frame_array->frame_count += gop.segments[i].frame_count;
+                gop.segments[i].frame_count = 0;
             }
+            frame_array->frame_rate = index->frame_rate;
+            frame_array->time_base = index->time_base;
+            frame_array->duration = gop.segments[segment_count - 1].end_pts;
+
+            DecodeStats *stats = &frame_array->decode_stats;
+            stats->codec = gop.segments[0].stats.codec;
+            stats->thread_type = gop.segments[0].stats.thread_type;
+            stats->thread_count = gop.segments[0].stats.thread_count;
+            stats->decoders = workers;
+            atomic_init(&stats->frames, frame_count);
+            atomic_init(&stats->decode_ns, now_ns() - start);
+            ret = 0;
         }
-        av_packet_unref(&packet);
     }
 
-    // Clean up
-    avcodec_free_context(&codec_ctx);
-    avformat_close_input(&format_ctx);
+    for (int i = 0; i < segment_count; i++) {
+        for (int j = 0; j < gop.segments[i].frame_count; j++) {
+            av_frame_free(&gop.segments[i].frames[j]);
+        }
+        free(gop.segments[i].frames);
+    }
+    free(gop.segments);
+    return ret;
+}
+
+// Frames are packed into one FrameArena as they come out of the decoder
+// when the index gives their count and size up front; those that don't
+// fit it stay in their own buffers
+FrameArray getFrames(const char *inputfile, const DecoderThreading *threading) {
+    uint64_t start = now_ns();
+    int workers = threading && threading->gop_workers > 0 ? threading->gop_workers : av_cpu_count();
+    FrameArray frame_array;
+    KeyframeIndex index;
+    FrameArena *arena = NULL;
 
+    bool indexed = indexKeyframes(inputfile, &index) == 0;
+    if (indexed) {
+        arena = createFrameArena(index.format, index.width, index.height, index.packet_count);
+    }
+    int ret = -1;
+    if (indexed && workers > 1) {
+        ret = getFramesParallel(inputfile, threading, workers, &index, arena, start, &frame_array);
+        // Slots the failed attempt took can't be reused
+        if (ret < 0 && arena) {
+            releaseFrameArena(arena);
+            arena = createFrameArena(index.format, index.width, index.height, index.packet_count);
+        }
+    }
+    if (ret < 0) {
+        frame_array = getFramesSerial(inputfile, threading, arena);
+    }
+
+    if (arena && frame_array.frame_count > 0 && frame_array.frames[0]->data[0] == arena->base) {
+        frame_array.arena_size = arena->size;
+        frame_array.arena_backing = arena->backing;
+    }
+    // The frames hold on to the arena from here on
+    releaseFrameArena(arena);
+    if (indexed) {
+        freeKeyframeIndex(&index);
+    }
     return frame_array;
 }
 
+// Memory held by a decoded frame
+size_t frameBytes(const AVFrame *frame) {
+    size_t bytes = sizeof(AVFrame);
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++) {
+        bytes += frame->buf[i]->size;
+    }
+    return bytes;
+}
+
 void freeFrameArray(FrameArray *frame_array) {
     for (int i = 0; i < frame_array->frame_count; i++) {
         av_frame_free(&frame_array->frames[i]);
@@ -126,26 +772,163 @@ void freeFrameArray(FrameArray *frame_array) {
     frame_array->frame_count = 0;
 }
 
-AVFrame *toARGB(AVFrame *frame)
-{
-    AVFrame *out_frame = av_frame_alloc();
-    if (!out_frame) {
-        fprintf(stderr, "Could not allocate destination frame\n");
-        return NULL;
+// Decodes the next frame, looping back to the start of the input at end
+// of file
+static int decodeLoopingFrame(VideoDecoder *decoder, AVFrame *frame) {
+    int ret = decodeNextFrame(decoder, frame);
+    if (ret == AVERROR_EOF) {
+        if (rewindDecoder(decoder) < 0)
+            return ret;
+        ret = decodeNextFrame(decoder, frame);
     }
+    return ret;
+}
 
-    out_frame->height = frame->height;
-    out_frame->width = frame->width;
-    out_frame->format = AV_PIX_FMT_ARGB;
+static void *decodeThread(void *arg) {
+    FrameRing *ring = arg;
 
-    if (av_frame_get_buffer(out_frame, 32) < 0) {
-        fprintf(stderr, "Could not allocate buffer for destination frame\n");
-        av_frame_free(&out_frame);
-        return NULL;
+    while (!atomic_load(&ring->stop)) {
+        sem_wait(&ring->space);
+        if (atomic_load(&ring->stop))
+            break;
+
+        unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        AVFrame *frame = ring->frames[tail % ring->size];
+        if (decodeLoopingFrame(ring->decoder, frame) < 0) {
+            fprintf(stderr, "Decoding failed, holding the last frame\n");
+            break;
+        }
+        if (ring->buffers.finish_frame) {
+            ring->buffers.finish_frame(ring->buffers.opaque, frame);
+        }
+
+        // Publish the frame only once it is fully written
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+        // Wake up the display loop in case it is waiting on us
+        uint64_t one = 1;
+        if (write(ring->notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            perror("eventfd write");
+        }
     }
+    return NULL;
+}
+
+// With cache_packets the whole clip is read into memory first and the
+// ring is filled from there, see cachePackets(). buffers may be NULL.
+int initFrameRing(FrameRing *ring, const char *inputfile, int size,
+                  const DecoderThreading *threading, bool cache_packets,
+                  const DecoderBuffers *buffers) {
+    memset(ring, 0, sizeof(*ring));
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->stop, false);
+    ring->notify_fd = -1;
 
-    struct SwsContext *sws_ctx = sws_getContext(frame->width, frame->height, frame->format, frame->width, frame->height, AV_PIX_FMT_BGRA, SWS_BICUBLIN, NULL, NULL, NULL);
-    sws_scale(sws_ctx, (const uint8_t * const *)frame->data, frame->linesize, 0, frame->height, out_frame->data, out_frame->linesize);
-    sws_freeContext(sws_ctx);
-    return out_frame;
+    ring->decoder = openDecoder(inputfile, threading);
+    if (!ring->decoder) {
+        return -1;
+    }
+    if (cache_packets && cachePackets(ring->decoder) < 0) {
+        freeFrameRing(ring);
+        return -1;
+    }
+    // Frame threads pick these up from the user context with every packet
+    if (buffers) {
+        ring->buffers = *buffers;
+        if (buffers->get_buffer2) {
+            ring->decoder->codec_ctx->get_buffer2 = buffers->get_buffer2;
+            ring->decoder->codec_ctx->opaque = buffers->opaque;
+        }
+    }
+
+    ring->size = size;
+    ring->frames = (AVFrame **)calloc(size, sizeof(AVFrame *));
+    for (int i = 0; i < size; i++) {
+        ring->frames[i] = av_frame_alloc();
+    }
+
+    // Only the first frame is decoded up front, the decode thread fills in
+    // the rest of the ring while the window is being set up
+    if (decodeLoopingFrame(ring->decoder, ring->frames[0]) < 0) {
+        fprintf(stderr, "Failed to decode the first frame\n");
+        freeFrameRing(ring);
+        return -1;
+    }
+    if (ring->buffers.finish_frame) {
+        ring->buffers.finish_frame(ring->buffers.opaque, ring->frames[0]);
+    }
+    atomic_store(&ring->tail, 1);
+
+    ring->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ring->notify_fd < 0) {
+        fprintf(stderr, "Failed to create the decode notification eventfd\n");
+        freeFrameRing(ring);
+        return -1;
+    }
+
+    sem_init(&ring->space, 0, size - 1);
+    if (pthread_create(&ring->thread, NULL, decodeThread, ring) != 0) {
+        fprintf(stderr, "Failed to start the decode thread\n");
+        freeFrameRing(ring);
+        return -1;
+    }
+    ring->thread_started = true;
+    return 0;
+}
+
+AVFrame *frameRingFront(FrameRing *ring) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return tail != head ? ring->frames[head % ring->size] : NULL;
+}
+
+// The frame after the front one, or NULL if it isn't decoded yet
+AVFrame *frameRingNext(FrameRing *ring) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return tail - head >= 2 ? ring->frames[(head + 1) % ring->size] : NULL;
+}
+
+// Drops the front frame and hands its slot back to the decode thread. The
+// last decoded frame is kept when the decoder has fallen behind, so the
+// display holds it instead of running dry.
+bool frameRingAdvance(FrameRing *ring) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (tail - head <= 1) {
+        return false;
+    }
+
+    av_frame_unref(ring->frames[head % ring->size]);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    sem_post(&ring->space);
+    return true;
+}
+
+int frameRingDepth(FrameRing *ring) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return tail - head;
+}
+
+void freeFrameRing(FrameRing *ring) {
+    if (ring->thread_started) {
+        atomic_store(&ring->stop, true);
+        sem_post(&ring->space);
+        pthread_join(ring->thread, NULL);
+        sem_destroy(&ring->space);
+    }
+    if (ring->frames) {
+        for (int i = 0; i < ring->size; i++) {
+            av_frame_free(&ring->frames[i]);
+        }
+        free(ring->frames);
+    }
+    if (ring->notify_fd >= 0) {
+        close(ring->notify_fd);
+    }
+    closeDecoder(&ring->decoder);
+    memset(ring, 0, sizeof(*ring));
 }
\ No newline at end of file
@@ -2,12 +2,154 @@
 #include <libavcodec/avcodec.h>
 #include <libavutil/imgutils.h>
 #include <libswscale/swscale.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 
+// How libavcodec may spread decoding over threads. thread_type is a mask
+// of FF_THREAD_FRAME/FF_THREAD_SLICE, 0 lets the codec use whatever it
+// supports; thread_count 0 means one per CPU, or an even share of the CPUs
+// when several decoders run side by side.
+//
+// getFrames() can additionally split the clip at keyframes and decode the
+// pieces on gop_workers decoders in parallel; 0 means one per CPU and 1
+// decodes serially.
+typedef struct {
+    int thread_type;
+    int thread_count;
+    int gop_workers;
+} DecoderThreading;
+
+// Buffers for the decoder to decode into instead of its own, e.g. memory
+// the compositor can read. get_buffer2 is installed as the codec's
+// AVCodecContext.get_buffer2 with opaque as AVCodecContext.opaque; it may
+// be called from several threads, and hands whatever it can't serve to
+// avcodec_default_get_buffer2().
+//
+// finish_frame, if set, is called with opaque on the decode thread with
+// every decoded frame before it is handed on, and may move the frame into
+// memory of its own, e.g. for frames the compositor can't take as decoded.
+typedef struct {
+    int (*get_buffer2)(AVCodecContext *ctx, AVFrame *frame, int flags);
+    void (*finish_frame)(void *opaque, AVFrame *frame);
+    void *opaque;
+} DecoderBuffers;
+
+// What the decoder settled on once opened, and how fast it has gone since.
+// The counters are only written by the thread doing the decoding.
+typedef struct {
+    const char *codec;
+    int thread_type;        // FF_THREAD_* actually in use, 0 for none
+    int thread_count;
+    int decoders;           // More than 1 for a GOP-parallel getFrames()
+    atomic_ulong frames;
+    atomic_ullong decode_ns; // Wall time spent in decodeNextFrame
+} DecodeStats;
+
+// Decoded frames carry their presentation time in frame->pts and their
+// display time in frame->duration, both in time_base units, with pts
+// counting from 0 at the first frame of the clip
 typedef struct {
     AVFrame **frames;
     int frame_count;
-    int frame_rate;
+    AVRational frame_rate;
+    AVRational time_base;
+    int64_t duration;       // Length of one loop of the clip
+    DecodeStats decode_stats;
+    size_t arena_size;      // Bytes of the arena the frames were packed into, 0 if not
+    const char *arena_backing;
 } FrameArray;
 
-FrameArray getFrames(const char *inputfile);
-AVFrame *toARGB(AVFrame *frame);
\ No newline at end of file
+// An open demuxer + decoder for the first video stream of a file
+typedef struct {
+    AVFormatContext *format_ctx;
+    AVCodecContext *codec_ctx;
+    AVPacket *packet;
+    int video_stream_index;
+    int draining;
+    AVRational frame_rate;  // Nominal rate, only a fallback for frame durations
+    AVRational time_base;
+    int64_t frame_duration; // 1 / frame_rate in time_base units
+    int64_t start_pts;      // Raw pts of the first frame
+    int64_t end_pts;        // Raw end time of the last frame seen
+    int64_t loop_offset;    // Added to the pts of every pass after a rewind
+    DecodeStats stats;
+    // The compressed video stream, once cachePackets() has read it all in;
+    // the file isn't read again after that
+    AVPacket **packets;
+    int packet_count;
+    int next_packet;
+    size_t packet_bytes;
+} VideoDecoder;
+
+// Bounded ring of decoded frames kept ahead of the playhead. A decode
+// thread is the single producer and the display loop the single consumer;
+// neither index is ever written by both sides so no lock is needed.
+typedef struct {
+    VideoDecoder *decoder;
+    AVFrame **frames;
+    int size;
+    atomic_uint head;       // Next frame to show, written by the consumer
+    atomic_uint tail;       // Next slot to decode into, written by the producer
+    sem_t space;            // Free slots, lets the producer sleep when full
+    int notify_fd;          // eventfd signalled whenever a frame is published
+    atomic_bool stop;
+    pthread_t thread;
+    bool thread_started;
+    DecoderBuffers buffers;
+} FrameRing;
+
+// Where each keyframe of the video stream is, found by reading every
+// packet without decoding any of them
+typedef struct {
+    int64_t seek_ts;        // Timestamp to seek to, the dts where there is one
+    int64_t pts;
+    int packet;             // Index of the packet within the video stream
+    int frame;              // Index of the keyframe in presentation order
+} Keyframe;
+
+typedef struct {
+    Keyframe *keyframes;
+    int count;
+    int packet_count;       // Also the number of frames
+    int64_t *frame_pts;     // Every frame in presentation order, from 0
+    int64_t first_pts;      // Earliest pts in the stream, where the clip starts
+    int64_t duration;       // Length of the clip
+    AVRational frame_rate;
+    AVRational time_base;
+    // Frame geometry as the codec parameters give it, before any decoding
+    int width;
+    int height;
+    enum AVPixelFormat format;
+} KeyframeIndex;
+
+int parseDecoderThreading(const char *spec, DecoderThreading *threading);
+const char *threadTypeName(int thread_type);
+double decodeFps(const DecodeStats *stats);
+
+// threading may be NULL for the default, which is the same as "auto"
+FrameArray getFrames(const char *inputfile, const DecoderThreading *threading);
+void freeFrameArray(FrameArray *frame_array);
+size_t frameBytes(const AVFrame *frame);
+
+VideoDecoder *openDecoder(const char *inputfile, const DecoderThreading *threading);
+int decodeNextFrame(VideoDecoder *decoder, AVFrame *frame);
+int seekDecoder(VideoDecoder *decoder, int64_t ts);
+int cachePackets(VideoDecoder *decoder);
+int rewindDecoder(VideoDecoder *decoder);
+void closeDecoder(VideoDecoder **decoder);
+
+int indexKeyframes(const char *inputfile, KeyframeIndex *index);
+int frameAtPts(const KeyframeIndex *index, int64_t pts);
+int keyframeBefore(const KeyframeIndex *index, int frame);
+void freeKeyframeIndex(KeyframeIndex *index);
+
+int initFrameRing(FrameRing *ring, const char *inputfile, int size,
+                  const DecoderThreading *threading, bool cache_packets,
+                  const DecoderBuffers *buffers);
+AVFrame *frameRingFront(FrameRing *ring);
+AVFrame *frameRingNext(FrameRing *ring);
+bool frameRingAdvance(FrameRing *ring);
+int frameRingDepth(FrameRing *ring);
+void freeFrameRing(FrameRing *ring);
\ No newline at end of file
@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include "framearena.h"
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define PLANE_ALIGN 64
+#define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE (2 << 20)
+
+// Huge pages from the reserved pool if there are enough of them, else
+// transparent huge pages if the kernel will give them, else normal pages
+static int mapArena(FrameArena *arena, size_t size) {
+    size_t huge_size = FFALIGN(size, HUGE_PAGE_SIZE);
+    arena->base = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (arena->base != MAP_FAILED) {
+        arena->size = huge_size;
+        arena->backing = "hugetlb";
+        return 0;
+    }
+
+    arena->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena->base == MAP_FAILED) {
+        arena->base = NULL;
+        return -1;
+    }
+    arena->size = size;
+    arena->backing = madvise(arena->base, size, MADV_HUGEPAGE) == 0 ? "thp" : "4k";
+    return 0;
+}
+
+// Returns NULL for formats whose planes can't be laid out this way, such
+// as paletted or hardware ones; their frames stay where the decoder put them
+FrameArena *createFrameArena(enum AVPixelFormat format, int width, int height, int slots) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL)) ||
+            width <= 0 || height <= 0 || slots <= 0) {
+        return NULL;
+    }
+
+    FrameArena *arena = calloc(1, sizeof(FrameArena));
+    if (!arena) {
+        return NULL;
+    }
+    arena->format = format;
+    arena->width = width;
+    arena->height = height;
+    arena->slots = slots;
+
+    size_t offset = 0;
+    int planes = av_pix_fmt_count_planes(format);
+    for (int i = 0; i < planes; i++) {
+        int shift = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+        arena->linesize[i] = FFALIGN(av_image_get_linesize(format, width, i), PLANE_ALIGN);
+        arena->plane_offset[i] = offset;
+        offset += FFALIGN((size_t)arena->linesize[i] * AV_CEIL_RSHIFT(height, shift), PLANE_ALIGN);
+    }
+    arena->slot_size = FFALIGN(offset, PAGE_SIZE);
+
+    arena->claimed = calloc(slots, sizeof(atomic_bool));
+    if (!arena->claimed || mapArena(arena, arena->slot_size * slots) < 0) {
+        fprintf(stderr, "Could not map a %zu MiB frame arena\n", (arena->slot_size * slots) >> 20);
+        free(arena->claimed);
+        free(arena);
+        return NULL;
+    }
+    atomic_init(&arena->refs, 1);
+    return arena;
+}
+
+static void arenaBufferFree(void *opaque, uint8_t *data) {
+    releaseFrameArena(opaque);
+}
+
+// Copies frame into the given slot and returns a frame backed by it, or
+// NULL if frame doesn't match the arena or the slot is out of range or
+// taken. Safe to call from several threads for different slots.
+AVFrame *arenaCopyFrame(FrameArena *arena, int slot, const AVFrame *frame) {
+    if (!arena || slot < 0 || slot >= arena->slots || frame->format != arena->format ||
+            frame->width != arena->width || frame->height != arena->height ||
+            atomic_exchange(&arena->claimed[slot], true)) {
+        return NULL;
+    }
+
+    AVFrame *packed = av_frame_alloc();
+    uint8_t *base = arena->base + (size_t)slot * arena->slot_size;
+    if (!packed || av_frame_copy_props(packed, frame) < 0) {
+        av_frame_free(&packed);
+        atomic_store(&arena->claimed[slot], false);
+        return NULL;
+    }
+    // The buffer gives its reference back when freed, so take it first
+    atomic_fetch_add(&arena->refs, 1);
+    packed->buf[0] = av_buffer_create(base, arena->slot_size, arenaBufferFree, arena, 0);
+    if (!packed->buf[0]) {
+        releaseFrameArena(arena);
+        av_frame_free(&packed);
+        atomic_store(&arena->claimed[slot], false);
+        return NULL;
+    }
+
+    packed->format = frame->format;
+    packed->width = frame->width;
+    packed->height = frame->height;
+    for (int i = 0; i < 4 && arena->linesize[i]; i++) {
+        packed->data[i] = base + arena->plane_offset[i];
+        packed->linesize[i] = arena->linesize[i];
+    }
+    av_image_copy(packed->data, packed->linesize, (const uint8_t **)frame->data, frame->linesize,
+                  frame->format, frame->width, frame->height);
+    return packed;
+}
+
+// Drops a reference, the creator's or a frame's
+void releaseFrameArena(FrameArena *arena) {
+    if (!arena || atomic_fetch_sub(&arena->refs, 1) > 1) {
+        return;
+    }
+    munmap(arena->base, arena->size);
+    free(arena->claimed);
+    free(arena);
+}
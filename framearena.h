@@ -0,0 +1,30 @@
+#include <libavutil/frame.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// One mapping holding the pixels of every decoded frame of a clip, a fixed
+// size slot per frame in presentation order. Every plane of a slot starts
+// on a cache line with a fixed stride and every slot on a page, so the
+// layout is the same for all frames and playback walks memory linearly.
+//
+// Frames copied in are ordinary AVFrames whose buffer points into their
+// slot. Each holds a reference on the arena, which is unmapped once the
+// last of them and the creator's reference are gone.
+typedef struct {
+    uint8_t *base;
+    size_t size;            // Bytes mapped
+    size_t slot_size;
+    int slots;
+    atomic_bool *claimed;   // Slots already holding a frame
+    enum AVPixelFormat format;
+    int width;
+    int height;
+    int linesize[4];
+    size_t plane_offset[4];
+    const char *backing;    // "hugetlb", "thp" or "4k" pages
+    atomic_int refs;
+} FrameArena;
+
+FrameArena *createFrameArena(enum AVPixelFormat format, int width, int height, int slots);
+AVFrame *arenaCopyFrame(FrameArena *arena, int slot, const AVFrame *frame);
+void releaseFrameArena(FrameArena *arena);
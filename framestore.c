@@ -0,0 +1,328 @@
+#include "ffmpeg.h"
+#include "damage.h"
+#include "framestore.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Everything below up to the decode thread is called with the lock held
+
+static bool inWindow(const FrameStore *store, int index) {
+    int distance = index - store->playhead;
+    if (distance < 0) {
+        distance += store->frame_count;
+    }
+    return distance < store->window;
+}
+
+static void lruUnlink(FrameStore *store, int index) {
+    int prev = store->lru_prev[index];
+    int next = store->lru_next[index];
+    if (prev >= 0)
+        store->lru_next[prev] = next;
+    else
+        store->lru_head = next;
+    if (next >= 0)
+        store->lru_prev[next] = prev;
+    else
+        store->lru_tail = prev;
+}
+
+static void lruPushFront(FrameStore *store, int index) {
+    store->lru_prev[index] = -1;
+    store->lru_next[index] = store->lru_head;
+    if (store->lru_head >= 0)
+        store->lru_prev[store->lru_head] = index;
+    store->lru_head = index;
+    if (store->lru_tail < 0)
+        store->lru_tail = index;
+}
+
+static void evict(FrameStore *store, int index) {
+    lruUnlink(store, index);
+    store->bytes -= frameBytes(store->frames[index]);
+    av_frame_free(&store->frames[index]);
+    store->stats.evictions++;
+}
+
+// Frees up bytes for a frame about to be stored. Only frames in the window
+// may push others out; the rest are kept only if there is room to spare.
+static bool makeRoom(FrameStore *store, int index, size_t bytes) {
+    if (!inWindow(store, index)) {
+        return store->bytes + bytes <= store->budget;
+    }
+
+    int victim = store->lru_tail;
+    while (store->bytes + bytes > store->budget && victim >= 0) {
+        int prev = store->lru_prev[victim];
+        if (!inWindow(store, victim)) {
+            evict(store, victim);
+        }
+        victim = prev;
+    }
+    // A window frame is stored even over budget; initFrameStore() sized the
+    // window so that this only happens when frame sizes vary a lot
+    return true;
+}
+
+static bool storeFrame(FrameStore *store, int index, AVFrame *frame) {
+    size_t bytes = frameBytes(frame);
+    if (store->frames[index] || !makeRoom(store, index, bytes)) {
+        store->stats.discarded++;
+        return false;
+    }
+
+    store->frames[index] = frame;
+    store->bytes += bytes;
+    lruPushFront(store, index);
+    if (store->was_resident[index]) {
+        store->stats.redecoded++;
+    }
+    store->was_resident[index] = true;
+    return true;
+}
+
+static int firstMissing(const FrameStore *store) {
+    for (int i = 0; i < store->window; i++) {
+        int index = (store->playhead + i) % store->frame_count;
+        if (!store->frames[index]) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+// Whether target can be reached by decoding on rather than seeking: the
+// decoder is at or before it and no further back than its keyframe
+static bool decoderReaches(const FrameStore *store, int target) {
+    const KeyframeIndex *index = &store->index;
+    if (store->decoder_next < 0 || store->decoder_next > target) {
+        return false;
+    }
+    return store->decoder_next >= index->keyframes[keyframeBefore(index, target)].frame;
+}
+
+static void *storeThread(void *arg) {
+    FrameStore *store = arg;
+    AVFrame *frame = av_frame_alloc();
+
+    pthread_mutex_lock(&store->lock);
+    while (!store->stop && frame) {
+        int target = firstMissing(store);
+        if (target < 0) {
+            pthread_cond_wait(&store->wake, &store->lock);
+            continue;
+        }
+
+        bool seek = !decoderReaches(store, target);
+        if (seek) {
+            store->stats.seeks++;
+        }
+        pthread_mutex_unlock(&store->lock);
+
+        double start = now_seconds();
+        int ret = 0;
+        if (seek) {
+            const Keyframe *key = &store->index.keyframes[keyframeBefore(&store->index, target)];
+            // The first frame may come before the first keyframe in
+            // decode order, only a seek to the very start gets it back
+            ret = seekDecoder(store->decoder, key->frame == 0 ? AV_NOPTS_VALUE : key->seek_ts);
+        }
+        if (ret >= 0) {
+            ret = decodeNextFrame(store->decoder, frame);
+        }
+        bool rewound = ret == AVERROR_EOF;
+        if (rewound) {
+            ret = seekDecoder(store->decoder, AV_NOPTS_VALUE);
+        }
+        double elapsed = now_seconds() - start;
+
+        pthread_mutex_lock(&store->lock);
+        store->stats.decode_time += elapsed;
+        if (ret < 0) {
+            fprintf(stderr, "Decoding failed, the frame store stops filling\n");
+            break;
+        }
+        if (seek) {
+            store->decoder_next = store->index.keyframes[keyframeBefore(&store->index, target)].frame;
+        }
+        if (rewound) {
+            store->decoder_next = 0;
+            continue;
+        }
+
+        int index = frameAtPts(&store->index, frame->pts);
+        store->decoder_next = index + 1;
+        store->stats.decoded++;
+        if (storeFrame(store, index, frame)) {
+            frame = av_frame_alloc();
+        } else {
+            av_frame_unref(frame);
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+
+    av_frame_free(&frame);
+    return NULL;
+}
+
+// budget is in bytes; ahead is how many frames from the playhead on the
+// decode thread keeps ready, fewer if the budget can't hold that many
+int initFrameStore(FrameStore *store, const char *inputfile, size_t budget, int ahead,
+                   const DecoderThreading *threading) {
+    memset(store, 0, sizeof(*store));
+    store->budget = budget;
+    store->lru_head = -1;
+    store->lru_tail = -1;
+
+    if (indexKeyframes(inputfile, &store->index) < 0) {
+        fprintf(stderr, "Could not index the keyframes of %s\n", inputfile);
+        return -1;
+    }
+    store->frame_count = store->index.packet_count;
+
+    store->decoder = openDecoder(inputfile, threading);
+    if (!store->decoder) {
+        freeFrameStore(store);
+        return -1;
+    }
+    // Frames are placed by pts relative to the clip start, wherever the
+    // decoder was seeked to
+    store->decoder->start_pts = store->index.first_pts;
+    store->decoder->end_pts = store->index.first_pts;
+
+    store->frames = (AVFrame **)calloc(store->frame_count, sizeof(AVFrame *));
+    store->was_resident = (bool *)calloc(store->frame_count, sizeof(bool));
+    store->lru_prev = (int *)calloc(store->frame_count, sizeof(int));
+    store->lru_next = (int *)calloc(store->frame_count, sizeof(int));
+    AVFrame *first = av_frame_alloc();
+    if (!store->frames || !store->was_resident || !store->lru_prev || !store->lru_next || !first) {
+        av_frame_free(&first);
+        freeFrameStore(store);
+        return -1;
+    }
+
+    // The first frame is decoded up front, for its size and to have
+    // something to show straight away
+    if (decodeNextFrame(store->decoder, first) < 0) {
+        fprintf(stderr, "Failed to decode the first frame\n");
+        av_frame_free(&first);
+        freeFrameStore(store);
+        return -1;
+    }
+    size_t frame_bytes = frameBytes(first);
+    store->window = 1;
+    int index = frameAtPts(&store->index, first->pts);
+    storeFrame(store, index, first);
+    store->decoder_next = index + 1;
+    store->stats.decoded++;
+
+    store->window = FFMIN(FFMIN(ahead, (int)(budget / frame_bytes)), store->frame_count);
+    if (store->window < 2) {
+        fprintf(stderr, "A budget of %zu MiB holds fewer than 2 frames of %zu KiB\n",
+                budget >> 20, frame_bytes >> 10);
+        freeFrameStore(store);
+        return -1;
+    }
+
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->wake, NULL);
+    if (pthread_create(&store->thread, NULL, storeThread, store) != 0) {
+        fprintf(stderr, "Failed to start the frame store decode thread\n");
+        freeFrameStore(store);
+        return -1;
+    }
+    store->thread_started = true;
+    return 0;
+}
+
+// Moves the playhead to index and returns that frame, or NULL if it isn't
+// decoded yet
+AVFrame *frameStoreGet(FrameStore *store, int index) {
+    pthread_mutex_lock(&store->lock);
+    AVFrame *frame = store->frames[index];
+    if (frame) {
+        store->stats.hits++;
+        lruUnlink(store, index);
+        lruPushFront(store, index);
+    } else {
+        store->stats.misses++;
+    }
+    if (index != store->playhead || !frame) {
+        store->playhead = index;
+        pthread_cond_signal(&store->wake);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return frame;
+}
+
+// Moves the playhead to index without taking the frame, and tells whether
+// it is there yet. Asked again until it is, only the first miss is counted.
+bool frameStoreRequest(FrameStore *store, int index) {
+    pthread_mutex_lock(&store->lock);
+    bool resident = store->frames[index] != NULL;
+    if (!resident && index != store->playhead) {
+        store->stats.misses++;
+    }
+    if (index != store->playhead || !resident) {
+        store->playhead = index;
+        pthread_cond_signal(&store->wake);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return resident;
+}
+
+// What changed from frame from to next, if from is still resident. Compared
+// under the lock, so that from can't be evicted meanwhile and needn't be
+// kept alive, and so over the budget, by a reference of the caller's.
+void frameStoreDamage(FrameStore *store, int from, const AVFrame *next, FrameDamage *damage) {
+    pthread_mutex_lock(&store->lock);
+    findFrameDamage(store->frames[from], next, damage);
+    pthread_mutex_unlock(&store->lock);
+}
+
+// Presentation time of a frame in seconds from the start of the clip
+double frameStoreTime(const FrameStore *store, int index) {
+    return store->index.frame_pts[index] * av_q2d(store->index.time_base);
+}
+
+void frameStoreStats(FrameStore *store, FrameStoreStats *stats, size_t *bytes) {
+    pthread_mutex_lock(&store->lock);
+    *stats = store->stats;
+    *bytes = store->bytes;
+    pthread_mutex_unlock(&store->lock);
+}
+
+void freeFrameStore(FrameStore *store) {
+    if (store->thread_started) {
+        pthread_mutex_lock(&store->lock);
+        store->stop = true;
+        pthread_cond_signal(&store->wake);
+        pthread_mutex_unlock(&store->lock);
+        pthread_join(store->thread, NULL);
+        store->thread_started = false;
+        pthread_cond_destroy(&store->wake);
+        pthread_mutex_destroy(&store->lock);
+    }
+
+    for (int i = 0; store->frames && i < store->frame_count; i++) {
+        av_frame_free(&store->frames[i]);
+    }
+    free(store->frames);
+    free(store->was_resident);
+    free(store->lru_prev);
+    free(store->lru_next);
+    store->frames = NULL;
+    store->was_resident = NULL;
+    store->lru_prev = NULL;
+    store->lru_next = NULL;
+    closeDecoder(&store->decoder);
+    freeKeyframeIndex(&store->index);
+}
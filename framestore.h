@@ -0,0 +1,50 @@
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;       // Frames that weren't there when due
+    unsigned long evictions;
+    unsigned long decoded;      // Every frame the decode thread produced
+    unsigned long redecoded;    // Frames decoded again after being evicted
+    unsigned long discarded;    // Decoded on the way to another frame, or no room
+    unsigned long seeks;
+    double decode_time;         // Seconds the decode thread spent decoding
+} FrameStoreStats;
+
+// Decoded frames of a whole clip, kept within a memory budget. Frames stay
+// for as long as they fit; when they don't, the least recently used ones
+// outside the window ahead of the playhead go first. A decode thread keeps
+// that window filled, seeking back to the keyframe before a missing frame
+// unless it can just carry on decoding.
+//
+// The frame at the playhead is never evicted, so the display loop can use
+// what frameStoreGet() returned until it asks for another frame.
+typedef struct {
+    VideoDecoder *decoder;
+    KeyframeIndex index;
+    int frame_count;
+    AVFrame **frames;           // NULL while not resident
+    bool *was_resident;         // To tell re-decodes from first decodes
+    int *lru_prev;              // Resident frames, most recently used first
+    int *lru_next;
+    int lru_head;
+    int lru_tail;
+    size_t bytes;
+    size_t budget;
+    int window;                 // Frames protected from the playhead on
+    int playhead;
+    int decoder_next;           // Frame the decoder produces next, -1 if unknown
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t thread;
+    bool thread_started;
+    bool stop;
+    FrameStoreStats stats;
+} FrameStore;
+
+int initFrameStore(FrameStore *store, const char *inputfile, size_t budget, int ahead,
+                   const DecoderThreading *threading);
+AVFrame *frameStoreGet(FrameStore *store, int index);
+bool frameStoreRequest(FrameStore *store, int index);
+void frameStoreDamage(FrameStore *store, int from, const AVFrame *next, FrameDamage *damage);
+double frameStoreTime(const FrameStore *store, int index);
+void frameStoreStats(FrameStore *store, FrameStoreStats *stats, size_t *bytes);
+void freeFrameStore(FrameStore *store);
@@ -0,0 +1,507 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "shm.h"
+
+/* Shared memory support code */
+static void
+randname(char *buf)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long r = ts.tv_nsec;
+    for (int i = 0; i < 6; ++i) {
+        buf[i] = 'A'+(r&15)+(r&16)*2;
+        r >>= 5;
+    }
+}
+
+static int
+create_shm_file(void)
+{
+    int fd = memfd_create("wl_shm", MFD_CLOEXEC);
+    if (fd >= 0)
+        return fd;
+
+    int retries = 100;
+    do {
+        char name[] = "/wl_shm-XXXXXX";
+        randname(name + sizeof(name) - 7);
+        --retries;
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            shm_unlink(name);
+            return fd;
+        }
+    } while (retries > 0 && errno == EEXIST);
+    return -1;
+}
+
+static int
+resize_shm_file(int fd, size_t size)
+{
+    int ret;
+    do {
+        ret = ftruncate(fd, size);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+int
+allocate_shm_file(size_t size)
+{
+    int fd = create_shm_file();
+    if (fd < 0)
+        return -1;
+    if (resize_shm_file(fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Planar YUV buffers keep their planes back to back, each chroma plane
+ * with its share of the stride, which is that of the first plane */
+size_t
+shm_buffer_size(uint32_t format, int stride, int height)
+{
+    size_t luma = (size_t)stride * height;
+    size_t chroma_rows = (height + 1) / 2;
+
+    switch (format) {
+    case WL_SHM_FORMAT_NV12:
+        return luma + (size_t)stride * chroma_rows;
+    case WL_SHM_FORMAT_YUV420:
+        return luma + 2 * (size_t)(stride / 2) * chroma_rows;
+    default:
+        return luma;
+    }
+}
+
+void
+shm_buffer_planes(uint32_t format, uint8_t *data, int stride, int height,
+        uint8_t *planes[4], int strides[4])
+{
+    size_t luma = (size_t)stride * height;
+    size_t chroma_rows = (height + 1) / 2;
+
+    memset(planes, 0, 4 * sizeof(*planes));
+    memset(strides, 0, 4 * sizeof(*strides));
+    planes[0] = data;
+    strides[0] = stride;
+    if (format == WL_SHM_FORMAT_NV12) {
+        planes[1] = data + luma;
+        strides[1] = stride;
+    } else if (format == WL_SHM_FORMAT_YUV420) {
+        planes[1] = data + luma;
+        planes[2] = planes[1] + (size_t)(stride / 2) * chroma_rows;
+        strides[1] = strides[2] = stride / 2;
+    }
+}
+
+/* Buffer pool */
+static void
+pool_buffer_release(void *data, struct wl_buffer *wl_buffer)
+{
+    /* Sent by the compositor when it's no longer using this buffer */
+    struct pool_buffer *buffer = data;
+    buffer->busy = false;
+}
+
+static const struct wl_buffer_listener pool_buffer_listener = {
+    .release = pool_buffer_release,
+};
+
+static void
+add_pool_buffer(struct buffer_pool *pool)
+{
+    struct pool_buffer *buffer = &pool->buffers[pool->count];
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->pool = pool;
+    buffer->data = pool->data + pool->count * pool->buffer_size;
+    buffer->wl_buffer = wl_shm_pool_create_buffer(pool->wl_shm_pool,
+            pool->count * pool->buffer_size, pool->width, pool->height,
+            pool->stride, pool->format);
+    wl_buffer_add_listener(buffer->wl_buffer, &pool_buffer_listener, buffer);
+    pool->count++;
+}
+
+int
+buffer_pool_init(struct buffer_pool *pool, struct wl_shm *wl_shm,
+        int width, int height, int stride, uint32_t format)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->wl_shm = wl_shm;
+    pool->width = width;
+    pool->height = height;
+    pool->stride = stride;
+    pool->format = format;
+    pool->buffer_size = shm_buffer_size(format, stride, height);
+    pool->size = pool->buffer_size * BUFFER_POOL_INITIAL;
+
+    pool->fd = allocate_shm_file(pool->size);
+    if (pool->fd < 0) {
+        fprintf(stderr, "Failed to allocate the buffer pool\n");
+        return -1;
+    }
+
+    pool->data = mmap(NULL, pool->size,
+            PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
+    if (pool->data == MAP_FAILED) {
+        close(pool->fd);
+        memset(pool, 0, sizeof(*pool));
+        return -1;
+    }
+
+    pool->wl_shm_pool = wl_shm_create_pool(wl_shm, pool->fd, pool->size);
+    for (int i = 0; i < BUFFER_POOL_INITIAL; ++i)
+        add_pool_buffer(pool);
+    return 0;
+}
+
+/* Grows the memfd and the compositor's view of it by one buffer */
+static int
+grow_buffer_pool(struct buffer_pool *pool)
+{
+    size_t size = pool->size + pool->buffer_size;
+    if (resize_shm_file(pool->fd, size) < 0)
+        return -1;
+
+    uint8_t *data = mremap(pool->data, pool->size, size, MREMAP_MAYMOVE);
+    if (data == MAP_FAILED)
+        return -1;
+
+    pool->data = data;
+    pool->size = size;
+    for (int i = 0; i < pool->count; ++i)
+        pool->buffers[i].data = data + i * pool->buffer_size;
+
+    wl_shm_pool_resize(pool->wl_shm_pool, size);
+    add_pool_buffer(pool);
+    pool->grown++;
+    return 0;
+}
+
+/* Returns a buffer the compositor is not using, marked busy, or NULL if
+ * every buffer is still held and the pool cannot grow any further, in
+ * which case the caller should skip this frame */
+struct pool_buffer *
+buffer_pool_acquire(struct buffer_pool *pool)
+{
+    for (int i = 0; i < pool->count; ++i) {
+        if (!pool->buffers[i].busy) {
+            pool->buffers[i].busy = true;
+            return &pool->buffers[i];
+        }
+    }
+
+    if (pool->count < BUFFER_POOL_MAX && grow_buffer_pool(pool) == 0) {
+        struct pool_buffer *buffer = &pool->buffers[pool->count - 1];
+        buffer->busy = true;
+        return buffer;
+    }
+
+    pool->exhausted++;
+    return NULL;
+}
+
+void
+buffer_pool_finish(struct buffer_pool *pool)
+{
+    if (!pool->wl_shm_pool)
+        return;
+    for (int i = 0; i < pool->count; ++i)
+        wl_buffer_destroy(pool->buffers[i].wl_buffer);
+    wl_shm_pool_destroy(pool->wl_shm_pool);
+    munmap(pool->data, pool->size);
+    close(pool->fd);
+    memset(pool, 0, sizeof(*pool));
+}
+
+/* Preloaded frames */
+/* Wraps count frames stored from offset onwards in fd. fd is duplicated,
+ * the caller keeps its own. Nothing is mapped on our side. */
+int
+preloaded_frames_init_fd(struct preloaded_frames *frames, struct wl_shm *wl_shm,
+        int fd, size_t offset, int count, int width, int height, int stride,
+        uint32_t format)
+{
+    memset(frames, 0, sizeof(*frames));
+    frames->width = width;
+    frames->height = height;
+    frames->stride = stride;
+    frames->count = count;
+    frames->offset = offset;
+    frames->frame_size = (size_t)stride * height;
+    frames->size = offset + frames->frame_size * count;
+
+    if (frames->size > INT32_MAX) {
+        fprintf(stderr, "%d frames need %zu MiB, more than one wl_shm_pool can hold\n",
+                count, frames->size >> 20);
+        return -1;
+    }
+
+    frames->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (frames->fd < 0) {
+        memset(frames, 0, sizeof(*frames));
+        return -1;
+    }
+
+    frames->wl_shm_pool = wl_shm_create_pool(wl_shm, frames->fd, frames->size);
+    frames->buffers = calloc(count, sizeof(struct wl_buffer *));
+    for (int i = 0; i < count; ++i) {
+        frames->buffers[i] = wl_shm_pool_create_buffer(frames->wl_shm_pool,
+                offset + i * frames->frame_size, width, height, stride, format);
+    }
+    return 0;
+}
+
+/* Maps the pool so that the frames can be written */
+int
+preloaded_frames_map(struct preloaded_frames *frames)
+{
+    frames->data = mmap(NULL, frames->size,
+            PROT_READ | PROT_WRITE, MAP_SHARED, frames->fd, 0);
+    if (frames->data == MAP_FAILED) {
+        frames->data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int
+preloaded_frames_init(struct preloaded_frames *frames, struct wl_shm *wl_shm,
+        int count, int width, int height, int stride, uint32_t format)
+{
+    size_t size = (size_t)stride * height * count;
+    if (size > INT32_MAX) {
+        fprintf(stderr, "%d frames need %zu MiB, more than one wl_shm_pool can hold\n",
+                count, size >> 20);
+        return -1;
+    }
+
+    int fd = allocate_shm_file(size);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to allocate shared memory for the frames\n");
+        return -1;
+    }
+
+    int ret = preloaded_frames_init_fd(frames, wl_shm, fd, 0, count,
+            width, height, stride, format);
+    close(fd);
+    if (ret < 0)
+        return -1;
+    if (preloaded_frames_map(frames) < 0) {
+        preloaded_frames_finish(frames);
+        return -1;
+    }
+    return 0;
+}
+
+uint8_t *
+preloaded_frame_data(struct preloaded_frames *frames, int index)
+{
+    return frames->data + frames->offset + index * frames->frame_size;
+}
+
+/* Drops our mapping once every frame is written; the compositor keeps its
+ * own and our RSS no longer carries the pixels */
+void
+preloaded_frames_unmap(struct preloaded_frames *frames)
+{
+    if (frames->data) {
+        munmap(frames->data, frames->size);
+        frames->data = NULL;
+    }
+}
+
+void
+preloaded_frames_finish(struct preloaded_frames *frames)
+{
+    if (!frames->wl_shm_pool)
+        return;
+    preloaded_frames_unmap(frames);
+    for (int i = 0; i < frames->count; ++i)
+        wl_buffer_destroy(frames->buffers[i]);
+    free(frames->buffers);
+    wl_shm_pool_destroy(frames->wl_shm_pool);
+    close(frames->fd);
+    memset(frames, 0, sizeof(*frames));
+}
+
+/* Decode pool */
+/* count is how many frames may be in the pool at once, at most
+ * DECODE_POOL_MAX */
+void
+decode_pool_init(struct decode_pool *pool, int count)
+{
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->fd = -1;
+    pool->count = count < DECODE_POOL_MAX ? count : DECODE_POOL_MAX;
+}
+
+/* Lays the pool out for frames of this geometry; rows may exceed height
+ * for decoders that write past the visible frame */
+static int
+decode_pool_layout(struct decode_pool *pool,
+        int width, int height, int rows, int stride, uint32_t format)
+{
+    pool->slot_size = (size_t)stride * rows;
+    pool->size = pool->slot_size * pool->count;
+    if (pool->size > INT32_MAX)
+        return -1;
+    pool->fd = allocate_shm_file(pool->size);
+    if (pool->fd < 0)
+        return -1;
+    pool->data = mmap(NULL, pool->size, PROT_READ | PROT_WRITE, MAP_SHARED, pool->fd, 0);
+    if (pool->data == MAP_FAILED) {
+        close(pool->fd);
+        pool->fd = -1;
+        pool->data = NULL;
+        return -1;
+    }
+
+    pool->width = width;
+    pool->height = height;
+    pool->stride = stride;
+    pool->format = format;
+    for (int i = 0; i < pool->count; ++i) {
+        pool->slots[i].pool = pool;
+        pool->slots[i].data = pool->data + i * pool->slot_size;
+    }
+    return 0;
+}
+
+/* Returns a free slot for a frame to be decoded into, or NULL if the
+ * frame doesn't match the pool or every slot is taken. Thread safe. */
+struct decode_slot *
+decode_pool_acquire(struct decode_pool *pool,
+        int width, int height, int rows, int stride, uint32_t format)
+{
+    struct decode_slot *slot = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->data && pool->count > 0 &&
+            decode_pool_layout(pool, width, height, rows, stride, format) < 0) {
+        fprintf(stderr, "Failed to allocate the decode pool, converting instead\n");
+        pool->count = 0;
+    }
+    if (pool->data && width == pool->width && height == pool->height &&
+            stride == pool->stride && format == pool->format &&
+            (size_t)stride * rows <= pool->slot_size) {
+        for (int i = 0; i < pool->count; ++i) {
+            if (!pool->slots[i].decoding && !pool->slots[i].attached) {
+                slot = &pool->slots[i];
+                slot->decoding = true;
+                pool->frames++;
+                break;
+            }
+        }
+        if (!slot)
+            pool->all_busy++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return slot;
+}
+
+/* The frame in the slot is gone. Thread safe. */
+void
+decode_slot_done(struct decode_slot *slot)
+{
+    pthread_mutex_lock(&slot->pool->lock);
+    slot->decoding = false;
+    pthread_mutex_unlock(&slot->pool->lock);
+}
+
+/* The slot a frame was decoded into, NULL if it wasn't decoded here */
+struct decode_slot *
+decode_pool_find(struct decode_pool *pool, const uint8_t *data)
+{
+    struct decode_slot *slot = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->data && data >= pool->data && data < pool->data + pool->size)
+        slot = &pool->slots[(data - pool->data) / pool->slot_size];
+    pthread_mutex_unlock(&pool->lock);
+    return slot;
+}
+
+static void
+decode_slot_release(void *data, struct wl_buffer *wl_buffer)
+{
+    struct decode_slot *slot = data;
+    pthread_mutex_lock(&slot->pool->lock);
+    slot->attached = false;
+    pthread_mutex_unlock(&slot->pool->lock);
+}
+
+static const struct wl_buffer_listener decode_slot_listener = {
+    .release = decode_slot_release,
+};
+
+/* Returns the slot's wl_buffer, marked as held by the compositor until it
+ * releases it. Display thread only. */
+struct wl_buffer *
+decode_slot_attach(struct decode_slot *slot, struct wl_shm *wl_shm)
+{
+    struct decode_pool *pool = slot->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->wl_shm_pool)
+        pool->wl_shm_pool = wl_shm_create_pool(wl_shm, pool->fd, pool->size);
+    if (!slot->wl_buffer) {
+        slot->wl_buffer = wl_shm_pool_create_buffer(pool->wl_shm_pool,
+                slot->data - pool->data, pool->width, pool->height,
+                pool->stride, pool->format);
+        wl_buffer_add_listener(slot->wl_buffer, &decode_slot_listener, slot);
+    }
+    slot->attached = true;
+    pthread_mutex_unlock(&pool->lock);
+    return slot->wl_buffer;
+}
+
+/* Only once the decoder is gone and no frame is left in a slot */
+void
+decode_pool_finish(struct decode_pool *pool)
+{
+    for (int i = 0; i < pool->count; ++i) {
+        if (pool->slots[i].wl_buffer)
+            wl_buffer_destroy(pool->slots[i].wl_buffer);
+    }
+    if (pool->wl_shm_pool)
+        wl_shm_pool_destroy(pool->wl_shm_pool);
+    if (pool->data)
+        munmap(pool->data, pool->size);
+    if (pool->fd >= 0)
+        close(pool->fd);
+    pthread_mutex_destroy(&pool->lock);
+    memset(pool, 0, sizeof(*pool));
+    pool->fd = -1;
+}
+
+/* A fully transparent ARGB8888 buffer. A fresh memfd reads as zeroes, so
+ * it is never mapped or touched on our side. */
+struct wl_buffer *
+create_blank_buffer(struct wl_shm *wl_shm, int width, int height)
+{
+    int stride = width * 4;
+    int size = stride * height;
+
+    int fd = allocate_shm_file(size);
+    if (fd == -1)
+        return NULL;
+
+    struct wl_shm_pool *pool = wl_shm_create_pool(wl_shm, fd, size);
+    struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0,
+            width, height, stride, WL_SHM_FORMAT_ARGB8888);
+    wl_shm_pool_destroy(pool);
+    close(fd);
+    return buffer;
+}
@@ -0,0 +1,124 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wayland-client.h>
+
+#define BUFFER_POOL_INITIAL 3
+#define BUFFER_POOL_MAX 4
+#define DECODE_POOL_MAX 32
+
+struct buffer_pool;
+
+struct pool_buffer {
+    struct buffer_pool *pool;
+    struct wl_buffer *wl_buffer;
+    uint8_t *data;
+    bool busy;   /* Attached and not yet released by the compositor */
+    /* The part that may hold anything but transparent pixels, for frames
+     * drawn in only where they are visible. Empty in a new buffer. */
+    int drawn_x, drawn_y, drawn_width, drawn_height;
+    unsigned long frame_seq;    /* Which frame shown it holds, 0 for none */
+};
+
+/* A fixed set of equally sized wl_buffers sharing one memfd and one
+ * mapping, recycled on wl_buffer.release */
+struct buffer_pool {
+    struct wl_shm *wl_shm;
+    struct wl_shm_pool *wl_shm_pool;
+    int fd;
+    uint8_t *data;
+    size_t size;
+    int width, height, stride;
+    uint32_t format;
+    size_t buffer_size;
+    int count;
+    struct pool_buffer buffers[BUFFER_POOL_MAX];
+    /* Stats */
+    unsigned long grown;     /* Buffers added because all were busy */
+    unsigned long exhausted; /* Frames skipped with every buffer busy */
+};
+
+int allocate_shm_file(size_t size);
+size_t shm_buffer_size(uint32_t format, int stride, int height);
+void shm_buffer_planes(uint32_t format, uint8_t *data, int stride, int height,
+        uint8_t *planes[4], int strides[4]);
+
+int buffer_pool_init(struct buffer_pool *pool, struct wl_shm *wl_shm,
+        int width, int height, int stride, uint32_t format);
+struct pool_buffer *buffer_pool_acquire(struct buffer_pool *pool);
+void buffer_pool_finish(struct buffer_pool *pool);
+
+/* Every frame of a clip converted once into its own region of a single
+ * wl_shm_pool, with one wl_buffer per frame created up front. The buffers
+ * are never written again after loading, so they need no release
+ * tracking and can be attached as often as we like.
+ *
+ * The pool is either a fresh memfd or any other file laid out the same
+ * way after offset bytes, such as an on-disk frame cache. */
+struct preloaded_frames {
+    struct wl_shm_pool *wl_shm_pool;
+    int fd;
+    uint8_t *data;   /* Only mapped while loading */
+    size_t size;     /* Of the whole pool, including the offset */
+    size_t offset;   /* Where the first frame starts */
+    size_t frame_size;
+    int width, height, stride;
+    int count;
+    struct wl_buffer **buffers;
+};
+
+int preloaded_frames_init(struct preloaded_frames *frames, struct wl_shm *wl_shm,
+        int count, int width, int height, int stride, uint32_t format);
+int preloaded_frames_init_fd(struct preloaded_frames *frames, struct wl_shm *wl_shm,
+        int fd, size_t offset, int count, int width, int height, int stride,
+        uint32_t format);
+int preloaded_frames_map(struct preloaded_frames *frames);
+uint8_t *preloaded_frame_data(struct preloaded_frames *frames, int index);
+void preloaded_frames_unmap(struct preloaded_frames *frames);
+void preloaded_frames_finish(struct preloaded_frames *frames);
+
+struct decode_pool;
+
+struct decode_slot {
+    struct decode_pool *pool;
+    struct wl_buffer *wl_buffer;    /* Created the first time it is shown */
+    uint8_t *data;
+    bool decoding;  /* Handed to the decoder, or holding a decoded frame */
+    bool attached;  /* Attached and not yet released by the compositor */
+};
+
+/* Buffers the decoder writes frames into directly, so that a decoded
+ * frame already is a wl_buffer and needs no conversion or copy.
+ *
+ * Slots are taken on the decode thread(s) and the memfd is laid out when
+ * the first one is, with that frame's geometry; frames of any other size
+ * are refused and decoded elsewhere. The wl_shm_pool and wl_buffers are
+ * only created on the display thread, the first time a slot is shown. A
+ * slot is free again once its frame is gone and the compositor has
+ * released it. */
+struct decode_pool {
+    pthread_mutex_t lock;
+    int fd;
+    uint8_t *data;
+    size_t size;
+    struct wl_shm_pool *wl_shm_pool;
+    int width, height, stride;
+    uint32_t format;
+    size_t slot_size;
+    int count;
+    struct decode_slot slots[DECODE_POOL_MAX];
+    /* Stats */
+    unsigned long frames;    /* Decoded straight into a slot */
+    unsigned long all_busy;  /* Decoded elsewhere as every slot was taken */
+};
+
+void decode_pool_init(struct decode_pool *pool, int count);
+struct decode_slot *decode_pool_acquire(struct decode_pool *pool,
+        int width, int height, int rows, int stride, uint32_t format);
+void decode_slot_done(struct decode_slot *slot);
+struct decode_slot *decode_pool_find(struct decode_pool *pool, const uint8_t *data);
+struct wl_buffer *decode_slot_attach(struct decode_slot *slot, struct wl_shm *wl_shm);
+void decode_pool_finish(struct decode_pool *pool);
+
+struct wl_buffer *create_blank_buffer(struct wl_shm *wl_shm, int width, int height);
@@ -0,0 +1,102 @@
+#include "workers.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Called and returns with the lock held
+static void runJobs(WorkerPool *pool) {
+    while (pool->next_job < pool->job_count) {
+        int job = pool->next_job++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->func(pool->arg, job);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->jobs_left == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+}
+
+static void *workerThread(void *arg) {
+    WorkerPool *pool = arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stop && pool->generation == seen) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stop) {
+            break;
+        }
+        seen = pool->generation;
+        runJobs(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+int initWorkerPool(WorkerPool *pool, int threads) {
+    *pool = (WorkerPool){ 0 };
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    if (threads > 1) {
+        pool->threads = calloc(threads - 1, sizeof(pthread_t));
+        if (!pool->threads) {
+            fprintf(stderr, "Could not allocate worker threads\n");
+            freeWorkerPool(pool);
+            return -1;
+        }
+    }
+    for (int i = 0; i < threads - 1; i++) {
+        if (pthread_create(&pool->threads[i], NULL, workerThread, pool) != 0) {
+            fprintf(stderr, "Could not start worker thread\n");
+            freeWorkerPool(pool);
+            return -1;
+        }
+        pool->thread_count++;
+    }
+    return 0;
+}
+
+void runWorkerPool(WorkerPool *pool, WorkFunc func, void *arg, int job_count) {
+    if (pool->thread_count == 0 || job_count == 1) {
+        for (int i = 0; i < job_count; i++) {
+            func(arg, i);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->func = func;
+    pool->arg = arg;
+    pool->job_count = job_count;
+    pool->next_job = 0;
+    pool->jobs_left = job_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+
+    runJobs(pool);
+    while (pool->jobs_left > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void freeWorkerPool(WorkerPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->thread_count = 0;
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+}
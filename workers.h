@@ -0,0 +1,26 @@
+#include <pthread.h>
+#include <stdbool.h>
+
+// A fixed set of threads that run numbered jobs on demand. The calling
+// thread takes jobs too, so a pool of N threads only spawns N - 1.
+typedef void (*WorkFunc)(void *arg, int job);
+
+typedef struct {
+    pthread_t *threads;
+    int thread_count;       // Spawned helpers, not counting the caller
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // A new batch of jobs was posted
+    pthread_cond_t done;    // The last job of the batch finished
+    WorkFunc func;
+    void *arg;
+    int job_count;
+    int next_job;
+    int jobs_left;
+    unsigned long generation;
+    bool stop;
+} WorkerPool;
+
+int initWorkerPool(WorkerPool *pool, int threads);
+// Runs func(arg, 0) .. func(arg, job_count - 1) and returns once all are done
+void runWorkerPool(WorkerPool *pool, WorkFunc func, void *arg, int job_count);
+void freeWorkerPool(WorkerPool *pool);
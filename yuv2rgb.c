@@ -0,0 +1,374 @@
+#include "yuv2rgb.h"
+#include <math.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define YUV_X86 1
+#include <immintrin.h>
+#endif
+
+#define COEFF_BITS 13
+#define COEFF_ROUND (1 << (COEFF_BITS - 1))
+
+void initYuvCoeffs(YuvCoeffs *coeffs, YuvMatrix matrix, bool full_range) {
+    double kr = matrix == YUV_MATRIX_BT709 ? 0.2126 : 0.299;
+    double kb = matrix == YUV_MATRIX_BT709 ? 0.0722 : 0.114;
+    double kg = 1.0 - kr - kb;
+    double y_scale = full_range ? 1.0 : 255.0 / 219.0;
+    double c_scale = full_range ? 1.0 : 255.0 / 224.0;
+    double one = 1 << COEFF_BITS;
+
+    coeffs->y_offset = full_range ? 0 : 16;
+    coeffs->y = lrint(y_scale * one);
+    coeffs->r_v = lrint(2.0 * (1.0 - kr) * c_scale * one);
+    coeffs->g_u = lrint(2.0 * (1.0 - kb) * kb / kg * c_scale * one);
+    coeffs->g_v = lrint(2.0 * (1.0 - kr) * kr / kg * c_scale * one);
+    coeffs->b_u = lrint(2.0 * (1.0 - kb) * c_scale * one);
+}
+
+// Scalar reference. The SIMD kernels do exactly the same integer math, one
+// pixel per 32-bit lane, so their output must match it bit for bit.
+
+static inline uint8_t clampPixel(int32_t v) {
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static inline void storePixel(uint8_t *dst, int32_t y, int32_t r_uv, int32_t g_uv, int32_t b_uv,
+                              const YuvCoeffs *c) {
+    int32_t luma = (y - c->y_offset) * c->y + COEFF_ROUND;
+    dst[0] = clampPixel((luma + b_uv) >> COEFF_BITS);
+    dst[1] = clampPixel((luma - g_uv) >> COEFF_BITS);
+    dst[2] = clampPixel((luma + r_uv) >> COEFF_BITS);
+    dst[3] = 0xff;
+}
+
+static inline void storePixelPair(const uint8_t *y, int32_t u, int32_t v, uint8_t *dst,
+                                  int count, const YuvCoeffs *c) {
+    u -= 128;
+    v -= 128;
+    int32_t r_uv = v * c->r_v;
+    int32_t g_uv = u * c->g_u + v * c->g_v;
+    int32_t b_uv = u * c->b_u;
+
+    storePixel(dst, y[0], r_uv, g_uv, b_uv, c);
+    if (count > 1)
+        storePixel(dst + 4, y[1], r_uv, g_uv, b_uv, c);
+}
+
+static void i420RowScalar(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                          uint8_t *dst, int width, const YuvCoeffs *c) {
+    for (int x = 0; x < width; x += 2) {
+        storePixelPair(y + x, u[x >> 1], v[x >> 1], dst + x * 4, width - x, c);
+    }
+}
+
+static void nv12RowScalar(const uint8_t *y, const uint8_t *uv, const uint8_t *unused,
+                          uint8_t *dst, int width, const YuvCoeffs *c) {
+    for (int x = 0; x < width; x += 2) {
+        storePixelPair(y + x, uv[x], uv[x + 1], dst + x * 4, width - x, c);
+    }
+}
+
+static const YuvKernel scalarKernel = { "scalar", i420RowScalar, nv12RowScalar };
+
+#ifdef YUV_X86
+
+// SSE4.1: 8 pixels per step, 4 chroma samples in 32-bit lanes
+
+__attribute__((target("sse4.1")))
+static inline __m128i packPixelsSse41(__m128i luma, __m128i r_uv, __m128i g_uv, __m128i b_uv) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi32(255);
+    const __m128i alpha = _mm_set1_epi32((int32_t)0xff000000);
+
+    __m128i b = _mm_srai_epi32(_mm_add_epi32(luma, b_uv), COEFF_BITS);
+    __m128i g = _mm_srai_epi32(_mm_sub_epi32(luma, g_uv), COEFF_BITS);
+    __m128i r = _mm_srai_epi32(_mm_add_epi32(luma, r_uv), COEFF_BITS);
+    b = _mm_min_epi32(_mm_max_epi32(b, zero), max);
+    g = _mm_min_epi32(_mm_max_epi32(g, zero), max);
+    r = _mm_min_epi32(_mm_max_epi32(r, zero), max);
+
+    return _mm_or_si128(_mm_or_si128(b, _mm_slli_epi32(g, 8)),
+                        _mm_or_si128(_mm_slli_epi32(r, 16), alpha));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i lumaSse41(__m128i y, const YuvCoeffs *c) {
+    y = _mm_sub_epi32(y, _mm_set1_epi32(c->y_offset));
+    return _mm_add_epi32(_mm_mullo_epi32(y, _mm_set1_epi32(c->y)), _mm_set1_epi32(COEFF_ROUND));
+}
+
+// u and v are 4 chroma samples with 128 already subtracted
+__attribute__((target("sse4.1")))
+static inline void storeBlockSse41(__m128i u, __m128i v, const uint8_t *y, uint8_t *dst,
+                                   const YuvCoeffs *c) {
+    __m128i r_uv = _mm_mullo_epi32(v, _mm_set1_epi32(c->r_v));
+    __m128i g_uv = _mm_add_epi32(_mm_mullo_epi32(u, _mm_set1_epi32(c->g_u)),
+                                 _mm_mullo_epi32(v, _mm_set1_epi32(c->g_v)));
+    __m128i b_uv = _mm_mullo_epi32(u, _mm_set1_epi32(c->b_u));
+
+    __m128i y8 = _mm_loadl_epi64((const __m128i *)y);
+    __m128i luma0 = lumaSse41(_mm_cvtepu8_epi32(y8), c);
+    __m128i luma1 = lumaSse41(_mm_cvtepu8_epi32(_mm_srli_si128(y8, 4)), c);
+
+    // Each chroma sample covers two neighbouring pixels
+    _mm_storeu_si128((__m128i *)dst,
+                     packPixelsSse41(luma0, _mm_shuffle_epi32(r_uv, 0x50),
+                                     _mm_shuffle_epi32(g_uv, 0x50), _mm_shuffle_epi32(b_uv, 0x50)));
+    _mm_storeu_si128((__m128i *)(dst + 16),
+                     packPixelsSse41(luma1, _mm_shuffle_epi32(r_uv, 0xfa),
+                                     _mm_shuffle_epi32(g_uv, 0xfa), _mm_shuffle_epi32(b_uv, 0xfa)));
+}
+
+__attribute__((target("sse4.1")))
+static void i420RowSse41(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                         uint8_t *dst, int width, const YuvCoeffs *c) {
+    const __m128i bias = _mm_set1_epi32(128);
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        int32_t u4, v4;
+        memcpy(&u4, u + x / 2, 4);
+        memcpy(&v4, v + x / 2, 4);
+        __m128i cu = _mm_sub_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(u4)), bias);
+        __m128i cv = _mm_sub_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v4)), bias);
+        storeBlockSse41(cu, cv, y + x, dst + x * 4, c);
+    }
+    i420RowScalar(y + x, u + x / 2, v + x / 2, dst + x * 4, width - x, c);
+}
+
+__attribute__((target("sse4.1")))
+static void nv12RowSse41(const uint8_t *y, const uint8_t *uv, const uint8_t *unused,
+                         uint8_t *dst, int width, const YuvCoeffs *c) {
+    const __m128i bias = _mm_set1_epi32(128);
+    const __m128i low_byte = _mm_set1_epi32(0xff);
+    int x = 0;
+
+    for (; x + 8 <= width; x += 8) {
+        // Each 16-bit UV pair widens to U | V << 8 in one lane
+        __m128i pairs = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(uv + x)));
+        __m128i cu = _mm_sub_epi32(_mm_and_si128(pairs, low_byte), bias);
+        __m128i cv = _mm_sub_epi32(_mm_srli_epi32(pairs, 8), bias);
+        storeBlockSse41(cu, cv, y + x, dst + x * 4, c);
+    }
+    nv12RowScalar(y + x, uv + x, NULL, dst + x * 4, width - x, c);
+}
+
+static const YuvKernel sse41Kernel = { "sse4.1", i420RowSse41, nv12RowSse41 };
+
+// AVX2: 16 pixels per step, 8 chroma samples
+
+__attribute__((target("avx2")))
+static inline __m256i packPixelsAvx2(__m256i luma, __m256i r_uv, __m256i g_uv, __m256i b_uv) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi32(255);
+    const __m256i alpha = _mm256_set1_epi32((int32_t)0xff000000);
+
+    __m256i b = _mm256_srai_epi32(_mm256_add_epi32(luma, b_uv), COEFF_BITS);
+    __m256i g = _mm256_srai_epi32(_mm256_sub_epi32(luma, g_uv), COEFF_BITS);
+    __m256i r = _mm256_srai_epi32(_mm256_add_epi32(luma, r_uv), COEFF_BITS);
+    b = _mm256_min_epi32(_mm256_max_epi32(b, zero), max);
+    g = _mm256_min_epi32(_mm256_max_epi32(g, zero), max);
+    r = _mm256_min_epi32(_mm256_max_epi32(r, zero), max);
+
+    return _mm256_or_si256(_mm256_or_si256(b, _mm256_slli_epi32(g, 8)),
+                           _mm256_or_si256(_mm256_slli_epi32(r, 16), alpha));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i lumaAvx2(__m256i y, const YuvCoeffs *c) {
+    y = _mm256_sub_epi32(y, _mm256_set1_epi32(c->y_offset));
+    return _mm256_add_epi32(_mm256_mullo_epi32(y, _mm256_set1_epi32(c->y)),
+                            _mm256_set1_epi32(COEFF_ROUND));
+}
+
+__attribute__((target("avx2")))
+static inline void storeBlockAvx2(__m256i u, __m256i v, const uint8_t *y, uint8_t *dst,
+                                  const YuvCoeffs *c) {
+    const __m256i first_half = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    const __m256i second_half = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+
+    __m256i r_uv = _mm256_mullo_epi32(v, _mm256_set1_epi32(c->r_v));
+    __m256i g_uv = _mm256_add_epi32(_mm256_mullo_epi32(u, _mm256_set1_epi32(c->g_u)),
+                                    _mm256_mullo_epi32(v, _mm256_set1_epi32(c->g_v)));
+    __m256i b_uv = _mm256_mullo_epi32(u, _mm256_set1_epi32(c->b_u));
+
+    __m128i y16 = _mm_loadu_si128((const __m128i *)y);
+    __m256i luma0 = lumaAvx2(_mm256_cvtepu8_epi32(y16), c);
+    __m256i luma1 = lumaAvx2(_mm256_cvtepu8_epi32(_mm_srli_si128(y16, 8)), c);
+
+    _mm256_storeu_si256((__m256i *)dst,
+                        packPixelsAvx2(luma0, _mm256_permutevar8x32_epi32(r_uv, first_half),
+                                       _mm256_permutevar8x32_epi32(g_uv, first_half),
+                                       _mm256_permutevar8x32_epi32(b_uv, first_half)));
+    _mm256_storeu_si256((__m256i *)(dst + 32),
+                        packPixelsAvx2(luma1, _mm256_permutevar8x32_epi32(r_uv, second_half),
+                                       _mm256_permutevar8x32_epi32(g_uv, second_half),
+                                       _mm256_permutevar8x32_epi32(b_uv, second_half)));
+}
+
+__attribute__((target("avx2")))
+static void i420RowAvx2(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                        uint8_t *dst, int width, const YuvCoeffs *c) {
+    const __m256i bias = _mm256_set1_epi32(128);
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m256i cu = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(u + x / 2))), bias);
+        __m256i cv = _mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(v + x / 2))), bias);
+        storeBlockAvx2(cu, cv, y + x, dst + x * 4, c);
+    }
+    i420RowScalar(y + x, u + x / 2, v + x / 2, dst + x * 4, width - x, c);
+}
+
+__attribute__((target("avx2")))
+static void nv12RowAvx2(const uint8_t *y, const uint8_t *uv, const uint8_t *unused,
+                        uint8_t *dst, int width, const YuvCoeffs *c) {
+    const __m256i bias = _mm256_set1_epi32(128);
+    const __m256i low_byte = _mm256_set1_epi32(0xff);
+    int x = 0;
+
+    for (; x + 16 <= width; x += 16) {
+        __m256i pairs = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(uv + x)));
+        __m256i cu = _mm256_sub_epi32(_mm256_and_si256(pairs, low_byte), bias);
+        __m256i cv = _mm256_sub_epi32(_mm256_srli_epi32(pairs, 8), bias);
+        storeBlockAvx2(cu, cv, y + x, dst + x * 4, c);
+    }
+    nv12RowScalar(y + x, uv + x, NULL, dst + x * 4, width - x, c);
+}
+
+static const YuvKernel avx2Kernel = { "avx2", i420RowAvx2, nv12RowAvx2 };
+
+// AVX-512: 32 pixels per step, 16 chroma samples
+
+__attribute__((target("avx512f")))
+static inline __m512i packPixelsAvx512(__m512i luma, __m512i r_uv, __m512i g_uv, __m512i b_uv) {
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i max = _mm512_set1_epi32(255);
+    const __m512i alpha = _mm512_set1_epi32((int32_t)0xff000000);
+
+    __m512i b = _mm512_srai_epi32(_mm512_add_epi32(luma, b_uv), COEFF_BITS);
+    __m512i g = _mm512_srai_epi32(_mm512_sub_epi32(luma, g_uv), COEFF_BITS);
+    __m512i r = _mm512_srai_epi32(_mm512_add_epi32(luma, r_uv), COEFF_BITS);
+    b = _mm512_min_epi32(_mm512_max_epi32(b, zero), max);
+    g = _mm512_min_epi32(_mm512_max_epi32(g, zero), max);
+    r = _mm512_min_epi32(_mm512_max_epi32(r, zero), max);
+
+    return _mm512_or_si512(_mm512_or_si512(b, _mm512_slli_epi32(g, 8)),
+                           _mm512_or_si512(_mm512_slli_epi32(r, 16), alpha));
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i lumaAvx512(__m512i y, const YuvCoeffs *c) {
+    y = _mm512_sub_epi32(y, _mm512_set1_epi32(c->y_offset));
+    return _mm512_add_epi32(_mm512_mullo_epi32(y, _mm512_set1_epi32(c->y)),
+                            _mm512_set1_epi32(COEFF_ROUND));
+}
+
+__attribute__((target("avx512f")))
+static inline void storeBlockAvx512(__m512i u, __m512i v, const uint8_t *y, uint8_t *dst,
+                                    const YuvCoeffs *c) {
+    const __m512i first_half = _mm512_set_epi32(7, 7, 6, 6, 5, 5, 4, 4, 3, 3, 2, 2, 1, 1, 0, 0);
+    const __m512i second_half = _mm512_set_epi32(15, 15, 14, 14, 13, 13, 12, 12,
+                                                 11, 11, 10, 10, 9, 9, 8, 8);
+
+    __m512i r_uv = _mm512_mullo_epi32(v, _mm512_set1_epi32(c->r_v));
+    __m512i g_uv = _mm512_add_epi32(_mm512_mullo_epi32(u, _mm512_set1_epi32(c->g_u)),
+                                    _mm512_mullo_epi32(v, _mm512_set1_epi32(c->g_v)));
+    __m512i b_uv = _mm512_mullo_epi32(u, _mm512_set1_epi32(c->b_u));
+
+    __m512i luma0 = lumaAvx512(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)y)), c);
+    __m512i luma1 = lumaAvx512(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(y + 16))), c);
+
+    _mm512_storeu_si512(dst,
+                        packPixelsAvx512(luma0, _mm512_permutexvar_epi32(first_half, r_uv),
+                                         _mm512_permutexvar_epi32(first_half, g_uv),
+                                         _mm512_permutexvar_epi32(first_half, b_uv)));
+    _mm512_storeu_si512(dst + 64,
+                        packPixelsAvx512(luma1, _mm512_permutexvar_epi32(second_half, r_uv),
+                                         _mm512_permutexvar_epi32(second_half, g_uv),
+                                         _mm512_permutexvar_epi32(second_half, b_uv)));
+}
+
+__attribute__((target("avx512f")))
+static void i420RowAvx512(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                          uint8_t *dst, int width, const YuvCoeffs *c) {
+    const __m512i bias = _mm512_set1_epi32(128);
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m512i cu = _mm512_sub_epi32(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(u + x / 2))), bias);
+        __m512i cv = _mm512_sub_epi32(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(v + x / 2))), bias);
+        storeBlockAvx512(cu, cv, y + x, dst + x * 4, c);
+    }
+    i420RowScalar(y + x, u + x / 2, v + x / 2, dst + x * 4, width - x, c);
+}
+
+__attribute__((target("avx512f")))
+static void nv12RowAvx512(const uint8_t *y, const uint8_t *uv, const uint8_t *unused,
+                          uint8_t *dst, int width, const YuvCoeffs *c) {
+    const __m512i bias = _mm512_set1_epi32(128);
+    const __m512i low_byte = _mm512_set1_epi32(0xff);
+    int x = 0;
+
+    for (; x + 32 <= width; x += 32) {
+        __m512i pairs = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(uv + x)));
+        __m512i cu = _mm512_sub_epi32(_mm512_and_si512(pairs, low_byte), bias);
+        __m512i cv = _mm512_sub_epi32(_mm512_srli_epi32(pairs, 8), bias);
+        storeBlockAvx512(cu, cv, y + x, dst + x * 4, c);
+    }
+    nv12RowScalar(y + x, uv + x, NULL, dst + x * 4, width - x, c);
+}
+
+static const YuvKernel avx512Kernel = { "avx512", i420RowAvx512, nv12RowAvx512 };
+
+#endif
+
+static const YuvKernel *kernels[4];
+static int kernel_count;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+// Looked up once, whichever of the decode and display threads converts first
+static void findKernels(void) {
+    int n = 0;
+    kernels[n++] = &scalarKernel;
+#ifdef YUV_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1"))
+        kernels[n++] = &sse41Kernel;
+    if (__builtin_cpu_supports("avx2"))
+        kernels[n++] = &avx2Kernel;
+    if (__builtin_cpu_supports("avx512f"))
+        kernels[n++] = &avx512Kernel;
+#endif
+    kernel_count = n;
+}
+
+const YuvKernel *const *supportedYuvKernels(int *count) {
+    pthread_once(&kernels_once, findKernels);
+
+    *count = kernel_count;
+    return kernels;
+}
+
+const YuvKernel *bestYuvKernel(void) {
+    int count;
+    const YuvKernel *const *kernels = supportedYuvKernels(&count);
+    return kernels[count - 1];
+}
+
+void convertYuvRows(const YuvKernel *kernel, bool nv12,
+                    const uint8_t *const planes[3], const int strides[3],
+                    uint8_t *dst, int dst_stride, int width,
+                    int y_start, int y_end, const YuvCoeffs *coeffs) {
+    for (int row = y_start; row < y_end; row++) {
+        const uint8_t *y = planes[0] + (ptrdiff_t)row * strides[0];
+        const uint8_t *u = planes[1] + (ptrdiff_t)(row >> 1) * strides[1];
+        const uint8_t *v = nv12 ? NULL : planes[2] + (ptrdiff_t)(row >> 1) * strides[2];
+        YuvRowFunc convert_row = nv12 ? kernel->nv12_row : kernel->i420_row;
+
+        convert_row(y, u, v, dst + (ptrdiff_t)row * dst_stride, width, coeffs);
+    }
+}
\ No newline at end of file
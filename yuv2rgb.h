@@ -0,0 +1,47 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+// Hand-written converters for the unscaled 8-bit YUV 4:2:0 to BGRA case
+// (Wayland's little-endian ARGB8888), which is nearly all of our content.
+// Everything else goes through swscale.
+
+typedef enum {
+    YUV_MATRIX_BT601,
+    YUV_MATRIX_BT709,
+} YuvMatrix;
+
+// Q13 fixed point coefficients, shared by every kernel so that they all
+// produce bit-identical output
+typedef struct {
+    int32_t y_offset;
+    int32_t y;
+    int32_t r_v;
+    int32_t g_u;
+    int32_t g_v;
+    int32_t b_u;
+} YuvCoeffs;
+
+// Converts one row. For I420 u and v are the chroma rows; for NV12 u is
+// the interleaved UV row and v is unused.
+typedef void (*YuvRowFunc)(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+                           uint8_t *dst, int width, const YuvCoeffs *coeffs);
+
+typedef struct {
+    const char *name;
+    YuvRowFunc i420_row;
+    YuvRowFunc nv12_row;
+} YuvKernel;
+
+void initYuvCoeffs(YuvCoeffs *coeffs, YuvMatrix matrix, bool full_range);
+
+// The fastest kernel this CPU supports
+const YuvKernel *bestYuvKernel(void);
+// Every kernel this CPU supports, starting with the scalar reference
+const YuvKernel *const *supportedYuvKernels(int *count);
+
+// Converts rows [y_start, y_end) of a 4:2:0 frame. planes/strides are the
+// Y, U, V planes (or Y, UV for NV12); y_start must be even.
+void convertYuvRows(const YuvKernel *kernel, bool nv12,
+                    const uint8_t *const planes[3], const int strides[3],
+                    uint8_t *dst, int dst_stride, int width,
+                    int y_start, int y_end, const YuvCoeffs *coeffs);
\ No newline at end of file